@@ -1,13 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cart.h"
+#include "crc32.h"
+#include "romdb.h"
 
 #define INES_HEADER_LEN 16
 #define TRAINER_LEN     512
 #define PRG_BLOCK_SIZE  16384
 #define CHR_BLOCK_SIZE  8192
+#define PRG_RAM_BLOCK_SIZE 8192
+#define TRAINER_ADDR    0x1000  // the trainer goes to $7000
+#define SAVE_EXT        ".sav"
+#define PRG_MAP_BANK    0x2000  // granularity of prg_map
+#define CHR_MAP_BANK    0x0400  // granularity of chr_map
 #define error_and_exit(X) do{perror(X); exit(EXIT_FAILURE);} while(0)
 
 /*
@@ -35,35 +47,47 @@ The format of the header is as follows:
 10: Flags 10 - TV system, PRG-RAM presence (unofficial, rarely used extension)
 11-15: Unused padding (should be filled with zero, but some rippers put their name across bytes 7-15)
 
+And from https://www.nesdev.org/wiki/NES_2.0, a header is NES 2.0 when bits
+2-3 of byte 7 are 10, in which case:
+
+8: Mapper bits 8-11 (low nibble), submapper (high nibble)
+9: PRG ROM size bits 8-11 (low nibble), CHR ROM size bits 8-11 (high nibble).
+   A nibble of $F means the size byte is EEEEEEMM: 2^E * (MM * 2 + 1) bytes
+10: PRG RAM (low nibble) and PRG NVRAM (high nibble) size, 64 << n bytes, 0: none
+11: CHR RAM (low nibble) and CHR NVRAM (high nibble) size, same encoding
+12: CPU/PPU timing, bits 0-1 (0: NTSC 1: PAL 2: multi-region 3: Dendy)
+
 */
 
 static const uint8_t iNES_SIG[4] = { 0x4E, 0x45, 0x53, 0x1A };
 
+static const char *timing_names[4] = { "NTSC", "PAL", "multi-region", "Dendy" };
 
-Cartridge *load_cart_from_file(char *fname)
+const char *cart_timing_name(Timing timing)
 {
-	Cartridge *cart = malloc(sizeof(Cartridge));
-
-	FILE *nes_file = fopen(fname, "r");
-	if (nes_file == NULL)
-		error_and_exit("Opening iNES file");
-
-	uint8_t header[INES_HEADER_LEN];
-	size_t bytes = fread(&header, 1, INES_HEADER_LEN, nes_file);
-	if (bytes != INES_HEADER_LEN)
-		error_and_exit("Reading iNES header");
+	return timing_names[timing & 0x03];
+}
 
-	// check signature
-	if (memcmp(&header, &iNES_SIG, 4))
-		error_and_exit("Invalid iNES signature");
+// NES 2.0 ROM size from its size byte and the matching nibble of byte 9.
+// Exponents past 2^31 give 0 since no board is that large
+static size_t nes2_rom_size(uint8_t lsb, uint8_t msb, size_t unit)
+{
+	if (msb != 0x0F)
+		return ((size_t)msb << 8 | lsb) * unit;
+	if ((lsb >> 2) >= 32)
+		return 0;
+	return ((size_t)1 << (lsb >> 2)) * ((lsb & 0x03) * 2 + 1);
+}
 
-	cart->prg_rom_size = header[4] * PRG_BLOCK_SIZE;
-	if (header[5] == 0)
-		header[5] = 1;
-	cart->chr_rom_size = header[5] * CHR_BLOCK_SIZE;
-	cart->prg_rom = malloc(cart->prg_rom_size);
-	cart->chr_rom = malloc(cart->chr_rom_size);
+// NES 2.0 RAM size nibble
+static size_t nes2_ram_size(uint8_t shift)
+{
+	return shift == 0 ? 0 : (size_t)64 << shift;
+}
 
+// Fields that mean the same thing in both header formats
+static void parse_common(Cartridge *cart, const uint8_t *header)
+{
 	cart->contains_ram     = header[6] & (1 << 1) ? true : false;
 	cart->trainer_present  = header[6] & (1 << 2) ? true : false;
 
@@ -78,73 +102,403 @@ Cartridge *load_cart_from_file(char *fname)
 		cart->mirroring = HORIZONTAL;
 	}
 
-	cart->mapper_id = 0;
-	cart->mapper_id |= ((header[6] >> 4) & 0x0F);
-	cart->mapper_id |= (header[7] & 0xF0);
+	cart->mapper_id = (header[6] >> 4) & 0x0F;
+}
 
-	if (cart->mapper_id & 0x10) {
-		fprintf(stderr, "Error: we do not currently support iNES 2.0 files");
-		exit(EXIT_FAILURE);
+static void parse_ines(Cartridge *cart, const uint8_t *header)
+{
+	cart->prg_rom_size = header[4] * PRG_BLOCK_SIZE;
+	cart->chr_rom_size = header[5] * CHR_BLOCK_SIZE;
+
+	// Old dumping tools wrote their name over bytes 7-15; if the padding
+	// isn't zero, byte 7 is probably part of it
+	static const uint8_t zeros[4] = { 0 };
+	if (!memcmp(&header[12], zeros, 4))
+		cart->mapper_id |= header[7] & 0xF0;
+
+	// byte 8 is PRG RAM in 8 KiB units, with 0 meaning 8 KiB for compatibility
+	cart->prg_ram_size = (header[8] ? header[8] : 1) * PRG_RAM_BLOCK_SIZE;
+	cart->timing = header[9] & 0x01 ? TIMING_PAL : TIMING_NTSC;
+}
+
+static const char *parse_nes2(Cartridge *cart, const uint8_t *header)
+{
+	cart->prg_rom_size = nes2_rom_size(header[4], header[9] & 0x0F, PRG_BLOCK_SIZE);
+	cart->chr_rom_size = nes2_rom_size(header[5], header[9] >> 4, CHR_BLOCK_SIZE);
+	if ((header[9] & 0x0F) == 0x0F && cart->prg_rom_size == 0)
+		return "PRG ROM size is too large";
+	if ((header[9] >> 4) == 0x0F && cart->chr_rom_size == 0)
+		return "CHR ROM size is too large";
+
+	// the exponent form can give sizes the banks can't be mapped from
+	if (cart->prg_rom_size % PRG_MAP_BANK != 0)
+		return "PRG ROM size is not a multiple of 8 KiB";
+	if (cart->chr_rom_size % CHR_MAP_BANK != 0)
+		return "CHR ROM size is not a multiple of 1 KiB";
+
+	cart->mapper_id |= (header[7] & 0xF0) | (header[8] & 0x0F) << 8;
+	cart->submapper = header[8] >> 4;
+
+	cart->prg_ram_size = nes2_ram_size(header[10] & 0x0F) + nes2_ram_size(header[10] >> 4);
+	cart->timing = header[12] & 0x03;
+	return NULL;
+}
+
+// Overrides the header with what is known about this exact dump
+static void apply_romdb(Cartridge *cart)
+{
+	const RomInfo *info = romdb_find(cart->crc);
+	if (info == NULL)
+		return;
+
+	cart->mapper_id = info->mapper_id;
+	cart->submapper = info->submapper;
+	if (info->mirroring != ROMDB_KEEP)
+		cart->mirroring = info->mirroring;
+	cart->prg_ram_size = info->prg_ram_kb * 1024;
+	cart->contains_ram = info->battery;
+	cart->timing = info->timing;
+}
+
+// Moves bit n of a byte to bit 2n
+static uint16_t spread_bits(uint8_t plane)
+{
+	uint16_t x = plane;
+	x = (x | x << 4) & 0x0F0F;
+	x = (x | x << 2) & 0x3333;
+	x = (x | x << 1) & 0x5555;
+	return x;
+}
+
+// Interleaves the two bit planes of a tile row into 2 bits per pixel
+static uint16_t expand_row(uint8_t lsb, uint8_t msb)
+{
+	return spread_bits(lsb) | spread_bits(msb) << 1;
+}
+
+static void update_chr_row(Cartridge *cart, uint16_t addr)
+{
+	uint16_t plane0 = addr & ~0x0008;
+	cart->chr_rows[(addr >> 4) << 3 | (addr & 0x07)] = expand_row(cart->chr_rom[plane0], cart->chr_rom[plane0 | 0x0008]);
+}
+
+
+// Where PRG ROM starts in the file
+static size_t cart_rom_offset(const Cartridge *cart)
+{
+	return INES_HEADER_LEN + (cart->trainer_present ? TRAINER_LEN : 0);
+}
+
+/*
+Fills in what the header says about cart->image, corrected by the ROM
+database, without allocating or mapping anything. Returns NULL if the
+file is usable, otherwise what is wrong with it. nes-index uses this to
+look at files it is not going to run.
+*/
+const char *cart_parse_header(Cartridge *cart)
+{
+	if (cart->image_size < INES_HEADER_LEN)
+		return "file is too short for an iNES header";
+
+	const uint8_t *header = cart->image;
+
+	// check signature
+	if (memcmp(header, &iNES_SIG, 4))
+		return "invalid iNES signature";
+
+	cart->nes2 = (header[7] & 0x0C) == 0x08;
+	parse_common(cart, header);
+	if (cart->nes2) {
+		const char *error = parse_nes2(cart, header);
+		if (error != NULL)
+			return error;
+	} else {
+		parse_ines(cart, header);
+	}
+
+	if (cart->prg_rom_size == 0)
+		return "the header declares no PRG ROM";
+
+	size_t needed = cart_rom_offset(cart) + cart->prg_rom_size + cart->chr_rom_size;
+	if (cart->image_size < needed)
+		return "file is shorter than the header says";
+
+	// one pass over PRG and CHR, which sit next to each other in the file
+	cart->crc = crc32_update(0, cart->image + cart_rom_offset(cart), cart->prg_rom_size + cart->chr_rom_size);
+	apply_romdb(cart);
+
+	// Without CHR ROM the board has CHR RAM: NES 2.0 says how much,
+	// iNES 1.0 boards all have 8 KiB. chr_map works in 1 KiB banks, so
+	// smaller sizes are rounded up and mirrored from there
+	cart->chr_is_ram = cart->chr_rom_size == 0;
+	if (cart->chr_is_ram) {
+		if (cart->nes2)
+			cart->chr_rom_size = nes2_ram_size(header[11] & 0x0F) + nes2_ram_size(header[11] >> 4);
+		if (cart->chr_rom_size == 0)
+			cart->chr_rom_size = CHR_BLOCK_SIZE;
+		cart->chr_rom_size = (cart->chr_rom_size + CHR_MAP_BANK - 1) & ~(size_t)(CHR_MAP_BANK - 1);
+	}
+
+	return NULL;
+}
+
+// <rom>.sav next to the ROM, replacing its extension
+static char *save_path(const char *rom_path)
+{
+	size_t len = strlen(rom_path);
+	const char *dot = strrchr(rom_path, '.');
+	const char *slash = strrchr(rom_path, '/');
+	if (dot != NULL && (slash == NULL || dot > slash))
+		len = (size_t)(dot - rom_path);
+
+	char *path = malloc(len + sizeof(SAVE_EXT));
+	memcpy(path, rom_path, len);
+	memcpy(path + len, SAVE_EXT, sizeof(SAVE_EXT));
+	return path;
+}
+
+// Maps the save file as the PRG RAM, creating or growing it as needed.
+// The game's writes then land in the page cache without any I/O on our
+// side and the kernel writes them back; cart_flush_save only asks it to
+// get on with it. Returns false if the file can't be used
+static bool map_save_file(Cartridge *cart, const char *rom_path)
+{
+	char *path = save_path(rom_path);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	bool ok = fd != -1 && fstat(fd, &st) != -1
+		&& ((size_t)st.st_size >= cart->prg_ram_size || ftruncate(fd, (off_t)cart->prg_ram_size) != -1);
+
+	if (ok) {
+		cart->prg_ram = mmap(NULL, cart->prg_ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		ok = cart->prg_ram != MAP_FAILED;
+	}
+	if (!ok) {
+		printf("[WARNING] Cannot use save file %s (%s); the game will not be saved\n", path, strerror(errno));
+		cart->prg_ram = NULL;
 	}
 
-	if (cart->trainer_present) {
-		int result = fseek(nes_file, TRAINER_LEN, SEEK_CUR);
-		if (result == -1) {
-			perror("Fseek nes file");
-			exit(EXIT_FAILURE);
-		}
+	if (fd != -1)
+		close(fd);
+	free(path);
+	return ok;
+}
+
+static void load_prg_ram(Cartridge *cart, const char *rom_path)
+{
+	if (cart->prg_ram_size == 0)
+		return;
+
+	// The memory map works in whole pages and mirrors the RAM across
+	// $6000-$7FFF, so sizes like 256 + 128 bytes of NVRAM are rounded up
+	// to a power of two; the save file is sized to match
+	size_t size = 0x100;
+	while (size < cart->prg_ram_size)
+		size <<= 1;
+	cart->prg_ram_size = size;
+
+	if (cart->contains_ram)
+		cart->prg_ram_is_save = map_save_file(cart, rom_path);
+	if (!cart->prg_ram_is_save)
+		cart->prg_ram = calloc(1, cart->prg_ram_size);
+
+	if (cart->trainer_present && cart->prg_ram_size >= TRAINER_ADDR + TRAINER_LEN)
+		memcpy(&cart->prg_ram[TRAINER_ADDR], cart->image + INES_HEADER_LEN, TRAINER_LEN);
+}
+
+/*
+The file is mapped read-only and prg_rom/chr_rom point straight into the
+mapping, so loading costs nothing up front and every emulator running the
+same ROM shares its pages. Only CHR RAM gets memory of its own.
+*/
+Cartridge *load_cart_from_file(char *fname)
+{
+	Cartridge *cart = calloc(1, sizeof(Cartridge));
+
+	int fd = open(fname, O_RDONLY);
+	if (fd == -1)
+		error_and_exit("Opening iNES file");
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		error_and_exit("Stat iNES file");
+
+	if (st.st_size == 0) {
+		fprintf(stderr, "Error: %s is empty\n", fname);
+		exit(EXIT_FAILURE);
 	}
 
-	size_t prg_rom_read = fread(cart->prg_rom, 1, cart->prg_rom_size, nes_file);
-	if (prg_rom_read != cart->prg_rom_size) {
-		perror("Loading PRG ROM");
+	cart->image_size = (size_t)st.st_size;
+	cart->image = mmap(NULL, cart->image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cart->image == MAP_FAILED)
+		error_and_exit("Mapping iNES file");
+	close(fd);
+
+	const char *error = cart_parse_header(cart);
+	if (error != NULL) {
+		fprintf(stderr, "Error: %s: %s\n", fname, error);
 		exit(EXIT_FAILURE);
 	}
+	if (romdb_find(cart->crc) != NULL)
+		printf("[WARNING] Header of ROM %08X is known to be wrong; using the database entry\n", cart->crc);
 
-	size_t chr_rom_read = fread(cart->chr_rom, 1, cart->chr_rom_size, nes_file);
-	if (chr_rom_read != cart->chr_rom_size) {
-		perror("Loading CHR ROM");
+	cart->mapper = find_mapper(cart->mapper_id);
+	if (cart->mapper == NULL) {
+		fprintf(stderr, "Error: mapper %u is not supported\n", cart->mapper_id);
 		exit(EXIT_FAILURE);
 	}
 
-	fprintf(stdout, "Successfully loaded iNES file with mapper %02X, %u prg banks, and %u chr banks\n",
-		    cart->mapper_id, header[4], header[5]);
+	if (cart->timing == TIMING_PAL || cart->timing == TIMING_DENDY)
+		printf("[WARNING] %s timing is not emulated; running as NTSC\n", timing_names[cart->timing]);
+
+	size_t offset = cart_rom_offset(cart);
+	cart->prg_rom = cart->image + offset;
+	if (cart->chr_is_ram)
+		cart->chr_rom = calloc(1, cart->chr_rom_size);
+	else
+		cart->chr_rom = cart->image + offset + cart->prg_rom_size;
+
+	cart->chr_rows = malloc(cart->chr_rom_size / 2 * sizeof(uint16_t));
+	for (size_t addr = 0; addr < cart->chr_rom_size; addr += 16)
+	{
+		for (size_t row = 0; row < 8; row++)
+			update_chr_row(cart, addr + row);
+	}
+
+	load_prg_ram(cart, fname);
+	cart->mapper->reset(cart);
+
+	fprintf(stdout, "Successfully loaded %s file with mapper %u.%u (%s), %zu KiB PRG ROM, %zu KiB CHR %s, %s, CRC32 %08X\n",
+		    cart->nes2 ? "NES 2.0" : "iNES", cart->mapper_id, cart->submapper, cart->mapper->name,
+		    cart->prg_rom_size / 1024, cart->chr_rom_size / 1024, cart->chr_is_ram ? "RAM" : "ROM",
+		    timing_names[cart->timing], cart->crc);
 
 	return cart;
 }
 
 void delete_cart(Cartridge *cart)
 {
-	free(cart->prg_rom);
-	free(cart->chr_rom);
+	if (cart->chr_is_ram)
+		free(cart->chr_rom);
+	if (cart->prg_ram_is_save) {
+		msync(cart->prg_ram, cart->prg_ram_size, MS_SYNC);
+		munmap(cart->prg_ram, cart->prg_ram_size);
+	} else {
+		free(cart->prg_ram);
+	}
+	munmap(cart->image, cart->image_size);
+	free(cart->chr_rows);
 	free(cart);
 }
 
 
+// `addr` is relative to $8000
 uint8_t cart_read_prg(Cartridge *cart, uint16_t addr) 
 {
-	if (cart->prg_rom_size == 0x4000 && addr >= 0x4000)
-		addr %= 0x4000;
-	return cart->prg_rom[addr];
+	return cart->prg_map[(addr >> 13) & 0x03][addr & 0x1FFF];
+}
+
+// Writes to $8000-$FFFF go to the mapper's registers
+void cart_write_prg(Cartridge *cart, uint16_t addr, uint8_t value)
+{
+	if (cart->mapper->write == NULL)
+		printf("[WARNING] Attemting to write to PRG ROM; ignoring\n");
+	else
+		cart->mapper->write(cart, addr, value);
 }
 
 uint8_t cart_read_chr(Cartridge *cart, uint16_t addr)
 {
-	if (addr > cart->chr_rom_size) {
-		fprintf(stderr, "[WARNING] Attempting to read addr %04X outside of CHR ROM boundary (size %04lx); returning 0\n",
-			    addr, cart->chr_rom_size);
-		return 0x00;
-	}
-	return cart->chr_rom[addr];
+	return cart->chr_map[(addr >> 10) & 0x07][addr & 0x03FF];
 }
 
 void cart_write_chr(Cartridge *cart, uint16_t addr, uint8_t value)
 {
-	if (!cart->contains_ram) {
+	if (!cart->chr_is_ram) {
 		fprintf(stderr, "[WARNING] Attempting to write to CHR ROM");
 
 	} else {
-		cart->chr_rom[addr] = value;
+		uint8_t *bank = cart->chr_map[(addr >> 10) & 0x07];
+		bank[addr & 0x03FF] = value;
+		update_chr_row(cart, (uint16_t)(bank - cart->chr_rom) + (addr & 0x03FF));
+	}
+}
+
+/*
+Bank switching. Both map `bank`, counted in units of `size` bytes, into
+slot `slot` of that size (slot 1 of 16 KiB PRG is $C000). Banks past the
+end of the ROM wrap around, which also mirrors small ROMs into bigger
+windows, and negative banks count back from the end: -1 is the last one.
+The mapper calls cart_update_map once it is done with the PRG side.
+*/
+void cart_map_prg(Cartridge *cart, int slot, size_t size, int bank)
+{
+	size_t count = size / PRG_MAP_BANK;
+	size_t start = bank >= 0 ? (size_t)bank * size : cart->prg_rom_size - (size_t)-bank * size % cart->prg_rom_size;
+
+	for (size_t i = 0; i < count; i++)
+		cart->prg_map[slot * count + i] = &cart->prg_rom[(start + i * PRG_MAP_BANK) % cart->prg_rom_size];
+}
+
+void cart_map_chr(Cartridge *cart, int slot, size_t size, int bank)
+{
+	size_t count = size / CHR_MAP_BANK;
+	size_t start = bank >= 0 ? (size_t)bank * size : cart->chr_rom_size - (size_t)-bank * size % cart->chr_rom_size;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t offset = (start + i * CHR_MAP_BANK) % cart->chr_rom_size;
+		cart->chr_map[slot * count + i] = &cart->chr_rom[offset];
+		cart->chr_row_map[slot * count + i] = &cart->chr_rows[offset / 2];
 	}
 }
 
+// Points the CPU pages for $6000-$7FFF at the PRG RAM and those for
+// $8000-$FFFF at the PRG ROM currently mapped there, so both skip the I/O
+// handlers entirely. Called when the cartridge is inserted and whenever
+// its PRG banks change
+void cart_update_map(Cartridge *cart)
+{
+	if (cart->cpu_read_map == NULL)
+		return;
+
+	for (size_t page = 0x60; page < 0x80; page++)
+	{
+		uint8_t *ram = cart->prg_ram != NULL ? &cart->prg_ram[((page - 0x60) << 8) % cart->prg_ram_size] : NULL;
+		cart->cpu_read_map[page] = ram;
+		cart->cpu_write_map[page] = ram;
+	}
+
+	for (size_t page = 0x80; page < 0x100; page++)
+	{
+		cart->cpu_read_map[page] = &cart->prg_map[(page >> 5) & 0x03][(page & 0x1F) << 8];
+		cart->cpu_write_map[page] = NULL;
+	}
+}
+
+// `addr` is $6000-$7FFF. Writes normally go straight through write_map;
+// this is for when they are trapped, and for carts without PRG RAM
+void cart_write_prg_ram(Cartridge *cart, uint16_t addr, uint8_t value)
+{
+	if (cart->prg_ram != NULL)
+		cart->prg_ram[(addr - 0x6000) % cart->prg_ram_size] = value;
+}
+
+// Routes PRG RAM writes through the CPU's I/O handlers (trap) or back
+// straight to memory
+void cart_trap_prg_ram_writes(Cartridge *cart, bool trap)
+{
+	if (cart->prg_ram == NULL || cart->cpu_write_map == NULL)
+		return;
+
+	for (size_t page = 0x60; page < 0x80; page++)
+		cart->cpu_write_map[page] = trap ? NULL : cart->cpu_read_map[page];
+}
+
+// Asks for battery RAM to be written back to the save file, without
+// waiting for it
+void cart_flush_save(Cartridge *cart)
+{
+	if (cart->prg_ram_is_save)
+		msync(cart->prg_ram, cart->prg_ram_size, MS_ASYNC);
+}
@@ -3,36 +3,103 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include "mapper.h"
 
 typedef enum Mirroring
 {
 	VERTICAL,
 	HORIZONTAL,
-	FOUR_SCREEN
+	FOUR_SCREEN,
+	SINGLE_SCREEN_LOW,   // mapper controlled, all four use CIRAM $000
+	SINGLE_SCREEN_HIGH   // mapper controlled, all four use CIRAM $400
 } Mirroring;
 
+// CPU/PPU timing the board was made for (NES 2.0 byte 12)
+typedef enum Timing
+{
+	TIMING_NTSC,
+	TIMING_PAL,
+	TIMING_MULTI,   // works on both
+	TIMING_DENDY
+} Timing;
+
 typedef struct Cartridge
 {
+	// the whole iNES file, mapped read-only
+	uint8_t *image;
+	size_t image_size;
+
+	// point into image, except CHR RAM which is writable memory of its own
 	uint8_t *prg_rom;
 	size_t prg_rom_size;  // in bytes
 
 	uint8_t *chr_rom;
 	size_t chr_rom_size;  // in bytes
 
+	// CHR memory pre-expanded for rendering: one 16-bit entry per tile row,
+	// 2 bits per pixel with the leftmost pixel in the top bits. Kept in step
+	// with chr_rom by cart_write_chr
+	uint16_t *chr_rows;
+	bool chr_is_ram;        // no CHR ROM in the file, the board has 8 KiB of CHR RAM
+
+	// What the CPU and PPU currently see: 8 KiB PRG banks at $8000, $A000,
+	// $C000 and $E000, and 1 KiB CHR banks at $0000-$1C00 (with their
+	// chr_rows counterparts). Only the mapper changes these, see mapper.c
+	uint8_t *prg_map[4];
+	uint8_t *chr_map[8];
+	uint16_t *chr_row_map[8];
+
+	// PRG RAM at $6000-$7FFF, mirrored if smaller than 8 KiB, NULL if the
+	// cart has none. With a battery it is a shared mapping of the save file
+	uint8_t *prg_ram;
+	size_t prg_ram_size;    // in bytes
+	bool prg_ram_is_save;   // prg_ram is mapped from the .sav file
+
+	bool nes2;              // the header is NES 2.0, not iNES 1.0
+	uint32_t crc;           // CRC-32 of PRG ROM followed by CHR ROM
+	Timing timing;
+
 	bool trainer_present;   // 1: 512-byte trainer at $7000-$71FF (stored before PRG data)
 	bool contains_ram;      // 1: Cartridge contains battery-backed PRG RAM ($6000-7FFF) or other persistent memory
 	bool ignore_mirroring;  // 1: Ignore mirroring control or above mirroring bit; instead provide four-screen VRAM
 	
 	Mirroring mirroring;    // 0: horizontal (vertical arrangement) (CIRAM A10 = PPU A11) 1: vertical (horizontal arrangement) (CIRAM A10 = PPU A10)
-	uint8_t mapper_id;
+	uint16_t mapper_id;
+	uint8_t submapper;      // NES 2.0 only, 0 otherwise
+	const Mapper *mapper;
+	MapperState mapper_state;
+	bool irq;               // the mapper is holding the CPU's IRQ line low
+
+	// the system the cartridge is plugged into, NULL until then
+	struct NES *nes;
 
+	// CPU page tables of the system the cartridge is plugged into;
+	// the cartridge owns the entries for $6000-$FFFF
+	uint8_t **cpu_read_map;
+	uint8_t **cpu_write_map;
 
 } Cartridge;
 
 Cartridge *load_cart_from_file(char *);
+const char *cart_parse_header(Cartridge *);
+const char *cart_timing_name(Timing);
 void delete_cart(Cartridge *);
 uint8_t cart_read_prg(Cartridge *, uint16_t);
+void cart_write_prg(Cartridge *, uint16_t, uint8_t);
 uint8_t cart_read_chr(Cartridge *, uint16_t);
 void cart_write_chr(Cartridge *, uint16_t, uint8_t);
+void cart_map_prg(Cartridge *, int, size_t, int);
+void cart_map_chr(Cartridge *, int, size_t, int);
+void cart_update_map(Cartridge *);
+void cart_write_prg_ram(Cartridge *, uint16_t, uint8_t);
+void cart_trap_prg_ram_writes(Cartridge *, bool);
+void cart_flush_save(Cartridge *);
+
+// Row of the tile at `addr` (tile * 16 + fine y) in both bit planes
+static inline uint16_t cart_chr_row(Cartridge *cart, uint16_t addr)
+{
+	return cart->chr_row_map[(addr >> 10) & 0x07][((addr & 0x03FF) >> 4) << 3 | (addr & 0x07)];
+}
 
 #endif
\ No newline at end of file
@@ -2,7 +2,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cpu.h"
+#include "nes.h"
+#include "opcodes.h"
 
 #define STACK_START    0x0100
 #define STACK_END      0x01FF
@@ -19,60 +25,131 @@
 
 // full instr set: https://www.masswerk.at/6502/6502_instruction_set.html
 // credit to OneLoneCoder for the idea behind this instruction set representation
+#define XXX NULL
+#define TABLE_ENTRY(opcode, operation, addr_mode, cycles) [opcode] = { #operation, operation, addr_mode, cycles },
 Instruction instruction_table[N_INSTRUCTIONS] = 
-{// -0                          -1                                -2                          -3                      -4                              -5                              -6                              -7                      -8                        -9                             -A                            -B                      -C                             -D                             -E                             -F
-	{"BRK", BRK, implied, 7},   {"ORA", ORA, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"ORA", ORA, zero_page, 3},     {"ASL", ASL, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"PHP", PHP, implied, 3}, {"ORA", ORA, immediate, 2},    {"ASL", ASL, accumulator, 2}, {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"ORA", ORA, absolute, 4},     {"ASL", ASL, absolute, 6},     {"XXX", NULL, NULL, 2}, // 2-
-	{"BPL", BPL, relative, 2},  {"ORA", ORA, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"ORA", ORA, zero_offset_x, 4}, {"ASL", ASL, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"CLC", CLC, implied, 2}, {"ORA", ORA, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"ORA", ORA, abs_offset_x, 4}, {"ASL", ASL, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // 1-
-	{"JSR", JSR, absolute, 6},  {"AND", AND, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"BIT", BIT, zero_page, 3},     {"AND", AND, zero_page, 3},     {"ROL", ROL, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"PLP", PLP, implied, 4}, {"AND", AND, immediate, 2},    {"ROL", ROL, accumulator, 2}, {"XXX", NULL, NULL, 2}, {"BIT", BIT, absolute, 4},     {"AND", AND, absolute, 4},     {"ROL", ROL, absolute, 6},     {"XXX", NULL, NULL, 2}, // 2-
-	{"BMI", BMI, relative, 2},  {"AND", AND, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"AND", AND, zero_offset_x, 4}, {"ROL", ROL, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"SEC", SEC, implied, 2}, {"AND", AND, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"AND", AND, abs_offset_x, 4}, {"ROL", ROL, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // 3-
-	{"RTI", RTI, implied, 6},   {"EOR", EOR, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"EOR", EOR, zero_page, 3},     {"LSR", LSR, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"PHA", PHA, implied, 3}, {"EOR", EOR, immediate, 2},    {"LSR", LSR, accumulator, 2}, {"XXX", NULL, NULL, 2}, {"JMP", JMP, absolute, 3},     {"EOR", EOR, absolute, 4},     {"LSR", LSR, absolute, 6},     {"XXX", NULL, NULL, 2}, // 4-
-	{"BVC", BVC, relative, 2},  {"EOR", EOR, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"EOR", EOR, zero_offset_x, 4}, {"LSR", LSR, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"CLI", CLI, implied, 2}, {"EOR", EOR, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"EOR", EOR, abs_offset_x, 4}, {"LSR", LSR, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // 5-
-	{"RTS", RTS, implied, 6},   {"ADC", ADC, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"ADC", ADC, zero_page, 3},     {"ROR", ROR, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"PLA", PLA, implied, 4}, {"ADC", ADC, immediate, 2},    {"ROR", ROR, accumulator, 2}, {"XXX", NULL, NULL, 2}, {"JMP", JMP, indirect, 5},     {"ADC", ADC, absolute, 4},     {"ROR", ROR, absolute, 6},     {"XXX", NULL, NULL, 2}, // 6-
-	{"BVS", BVS, relative, 2},  {"ADC", ADC, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"ADC", ADC, zero_offset_x, 4}, {"ROR", ROR, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"SEI", SEI, implied, 2}, {"ADC", ADC, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"ADC", ADC, abs_offset_x, 4}, {"ROR", ROR, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // 7-
-	{"XXX", NULL, NULL, 2},     {"STA", STA, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"STY", STY, zero_page, 3},     {"STA", STA, zero_page, 3},     {"STX", STX, zero_page, 3},     {"XXX", NULL, NULL, 2}, {"DEY", DEY, implied, 2}, {"XXX", NULL, NULL, 2},        {"TXA", TXA, implied, 2},     {"XXX", NULL, NULL, 2}, {"STY", STY, absolute, 4},     {"STA", STA, absolute, 4},     {"STX", STX, absolute, 4},     {"XXX", NULL, NULL, 2}, // 8-
-	{"BCC", BCC, relative, 2},  {"STA", STA, zero_indirect_y, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"STY", STY, zero_offset_x, 4}, {"STA", STA, zero_offset_x, 4}, {"STX", STX, zero_offset_y, 4}, {"XXX", NULL, NULL, 2}, {"TYA", TYA, implied, 2}, {"STA", STA, abs_offset_y, 5}, {"TXS", TXS, implied, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"STA", STA, abs_offset_x, 5}, {"XXX", NULL, NULL, 2},        {"XXX", NULL, NULL, 2}, // 9-
-	{"LDY", LDY, immediate, 2}, {"LDA", LDA, zero_indirect_x, 6}, {"LDX", LDX, immediate, 2}, {"XXX", NULL, NULL, 2}, {"LDY", LDY, zero_page, 3},     {"LDA", LDA, zero_page, 3},     {"LDX", LDX, zero_page, 3},     {"XXX", NULL, NULL, 2}, {"TAY", TAY, implied, 2}, {"LDA", LDA, immediate, 2},    {"TAX", TAX, implied, 2},     {"XXX", NULL, NULL, 2}, {"LDY", LDY, absolute, 4},     {"LDA", LDA, absolute, 4},     {"LDX", LDX, absolute, 4},     {"XXX", NULL, NULL, 2}, // A-
-	{"BCS", BCS, relative, 2},  {"LDA", LDA, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"LDY", LDY, zero_offset_x, 4}, {"LDA", LDA, zero_offset_x, 4}, {"LDX", LDX, zero_offset_y, 4}, {"XXX", NULL, NULL, 2}, {"CLV", CLV, implied, 2}, {"LDA", LDA, abs_offset_y, 4}, {"TSX", TSX, implied, 2},     {"XXX", NULL, NULL, 2}, {"LDY", LDY, abs_offset_x, 4}, {"LDA", LDA, abs_offset_x, 4}, {"LDX", LDX, abs_offset_y, 4}, {"XXX", NULL, NULL, 2}, // B-
-	{"CPY", CPY, immediate, 2}, {"CMP", CMP, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"CPY", CPY, zero_page, 3},     {"CMP", CMP, zero_page, 3},     {"DEC", DEC, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"INY", INY, implied, 2}, {"CMP", CMP, immediate, 2},    {"DEX", DEX, implied, 2},     {"XXX", NULL, NULL, 2}, {"CPY", CPY, absolute, 4},     {"CMP", CMP, absolute, 4},     {"DEC", DEC, absolute, 6},     {"XXX", NULL, NULL, 2}, // C-
-	{"BNE", BNE, relative, 2},  {"CMP", CMP, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"CMP", CMP, zero_offset_x, 4}, {"DEC", DEC, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"CLD", CLD, implied, 2}, {"CMP", CMP, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"CMP", CMP, abs_offset_x, 4}, {"DEC", DEC, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // D-
-	{"CPX", CPX, immediate, 2}, {"SBC", SBC, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"CPX", CPX, zero_page, 3},     {"SBC", SBC, zero_page, 3},     {"INC", INC, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"INX", INX, implied, 2}, {"SBC", SBC, immediate, 2},    {"NOP", NOP, implied, 2},     {"XXX", NULL, NULL, 2}, {"CPX", CPX, absolute, 4},     {"SBC", SBC, absolute, 4},     {"INC", INC, absolute, 6},     {"XXX", NULL, NULL, 2}, // E-
-	{"BEQ", BEQ, relative, 2},  {"SBC", SBC, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"SBC", SBC, zero_offset_x, 4}, {"INC", INC, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"SED", SED, implied, 2}, {"SBC", SBC, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"SBC", SBC, abs_offset_x, 4}, {"INC", INC, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // F-
+{
+	OPCODE_TABLE(TABLE_ENTRY)
 };
+#undef TABLE_ENTRY
+#undef XXX
 
-typedef struct NES NES;
-void cpu_write(NES *, uint16_t, uint8_t);
-uint8_t cpu_read(NES *, uint16_t);
 
 CPU *init_cpu()
 {
-	CPU *cpu = malloc(sizeof(CPU));
+	CPU *cpu = calloc(1, sizeof(CPU));
+	cpu->core = CPU_CORE_FUSED;
+	cpu->nz_src = 1;  // N and Z clear, like the zeroed bitfields used to be
 	return cpu;
 }
 
+uint8_t instruction_length(const Instruction *inst)
+{
+	void (*mode)(CPU *) = inst->addr_mode;
+
+	if (mode == absolute || mode == indirect || mode == abs_offset_x || mode == abs_offset_y)
+		return 3;
+	if (mode == NULL || mode == implied || mode == accumulator)
+		return 1;
+	return 2;
+}
+
+#ifdef NES_TRACE
+void cpu_trace_instruction(CPU *cpu, uint8_t opcode)
+{
+	TraceRecord record;
+	uint8_t length = instruction_length(&instruction_table[opcode]);
+
+	record.PC = cpu->PC;
+	record.opcode = opcode;
+	record.operands[0] = length > 1 ? cpu_read(cpu->nes, cpu->PC + 1) : 0x00;
+	record.operands[1] = length > 2 ? cpu_read(cpu->nes, cpu->PC + 2) : 0x00;
+	record.A = cpu->A;
+	record.X = cpu->X;
+	record.Y = cpu->Y;
+	record.P = get_flags(cpu);
+	record.SP = cpu->SP;
+	record.cycle = (uint32_t)cpu->total_cycles;
+
+	cpu->tracer(cpu->tracer_ctx, &record);
+}
+#endif
+
+void cpu_set_tracer(CPU *cpu, TraceHook hook, void *ctx)
+{
+	cpu->tracer = hook;
+	cpu->tracer_ctx = ctx;
+}
+
 static void run_next_instruction(CPU *cpu)
 {
 	cpu->operand = 0x0000;
 
-	printf("%04X:  ", cpu->PC);
-
 	uint8_t opcode = cpu_read(cpu->nes, cpu->PC);
 	Instruction *current_inst = &instruction_table[opcode];
 	cpu->current_inst = current_inst;
 
+#ifdef NES_TRACE
+	if (cpu->tracer != NULL)
+		cpu_trace_instruction(cpu, opcode);
+#endif
+
+	// unofficial opcodes are treated as single byte NOPs
+	if (current_inst->operation == NULL) {
+		cpu->PC += 1;
+	} else {
+		current_inst->addr_mode(cpu);
+		current_inst->operation(cpu);
+	}
+
+	// total_cycles is only advanced once the instruction is done, so bus
+	// accesses made by it see the cycle the instruction started on
 	cpu->current_cycles += current_inst->clock_cycles;
 	cpu->total_cycles   += current_inst->clock_cycles;
-
-	current_inst->addr_mode(cpu);
-	current_inst->operation(cpu);
 }
 
 void clock_cpu(CPU *cpu)
 {
 	if (cpu->current_cycles)
 		cpu->current_cycles--;
-	else {
+	else if (cpu->core == CPU_CORE_TABLE)
 		run_next_instruction(cpu);
+	else
+		run_next_instruction_fused(cpu);
+}
+
+// Executes one whole instruction right away. Used by the scheduler in
+// nes.c, which keeps time through total_cycles instead of counting
+// current_cycles down one clock at a time
+void cpu_step(CPU *cpu)
+{
+	if (cpu->core == CPU_CORE_TABLE)
+		run_next_instruction(cpu);
+	else
+		run_next_instruction_fused(cpu);
+	cpu->current_cycles = 0;
+}
+
+// Executes whole instructions until total_cycles reaches `until`
+void cpu_run(CPU *cpu, uint64_t until)
+{
+	if (cpu->core == CPU_CORE_JIT && cpu->jit == NULL) {
+		cpu->jit = jit_create();
+		if (cpu->jit == NULL) {
+			fprintf(stderr, "[WARNING] JIT is not available here; falling back to the table interpreter\n");
+			cpu->core = CPU_CORE_TABLE;
+		}
 	}
+
+	if (cpu->core == CPU_CORE_BLOCK || cpu->core == CPU_CORE_JIT) {
+		if (cpu->blocks == NULL)
+			cpu->blocks = block_cache_create();
+		run_blocks(cpu, until);
+		return;
+	}
+
+	while (cpu->total_cycles < until && !cpu->stop)
+		cpu_step(cpu);
 }
 
 void connect_system(CPU *cpu, struct NES *nes) { cpu->nes = nes; }
@@ -93,6 +170,10 @@ void reset_cpu(CPU *cpu)
 
 void delete_cpu(CPU *cpu)
 {
+	if (cpu->blocks != NULL)
+		block_cache_delete(cpu->blocks);
+	if (cpu->jit != NULL)
+		jit_delete(cpu->jit);
 	free(cpu);
 }
 
@@ -101,13 +182,13 @@ uint8_t get_flags(CPU *cpu)
 	uint8_t result = 0x00;
 
 	result |= cpu->C << 0;
-	result |= cpu->Z << 1;
+	result |= cpu_flag_z(cpu) << 1;
 	result |= cpu->I << 2;
 	result |= cpu->D << 3;
 	result |= cpu->B << 4;
 	result |= cpu->U << 5;
-	result |= cpu->V << 6;
-	result |= cpu->N << 7;
+	result |= cpu_flag_v(cpu) << 6;
+	result |= cpu_flag_n(cpu) << 7;
 
 	return result;
 }
@@ -115,13 +196,12 @@ uint8_t get_flags(CPU *cpu)
 void set_flags(CPU *cpu, uint8_t flags)
 {
 	cpu->C = flags & 1 << 0 ? 1 : 0;
-	cpu->Z = flags & 1 << 1 ? 1 : 0;
 	cpu->I = flags & 1 << 2 ? 1 : 0;
 	cpu->D = flags & 1 << 3 ? 1 : 0;
 	cpu->B = flags & 1 << 4 ? 1 : 0;
 	cpu->U = 1;  // always 1
-	cpu->V = flags & 1 << 6 ? 1 : 0;
-	cpu->N = flags & 1 << 7 ? 1 : 0;
+	cpu->v_src = flags << 1;
+	cpu_set_nz(cpu, flags & 1 << 7, flags & 1 << 1);
 }
 
 void dump_cpu(CPU *cpu, FILE *f)
@@ -130,11 +210,11 @@ void dump_cpu(CPU *cpu, FILE *f)
 	{
 		if (i % 8 == 0)
 			printf("\n");
-		printf("%02X ", cpu->memory[i]);
+		printf("%02X ", cpu->ram[i]);
 	}
 
-	fprintf(f, "\nA:%02X X:%02X Y:%02X P:%02X SP:%02X  PPU: --, -- CYC:%u\n\n", cpu->A, cpu->X, cpu->Y, get_flags(cpu), cpu->SP, cpu->total_cycles);
-	fprintf(f, "Flags: NVUBDIZC\n       %d%d%d%d%d%d%d%d\n\n", cpu->N, cpu->V, cpu->U, cpu->B, cpu->D, cpu->I, cpu->Z, cpu->C);
+	fprintf(f, "\nA:%02X X:%02X Y:%02X P:%02X SP:%02X  PPU: --, -- CYC:%llu\n\n", cpu->A, cpu->X, cpu->Y, get_flags(cpu), cpu->SP, (unsigned long long)cpu->total_cycles);
+	fprintf(f, "Flags: NVUBDIZC\n       %d%d%d%d%d%d%d%d\n\n", cpu_flag_n(cpu), cpu_flag_v(cpu), cpu->U, cpu->B, cpu->D, cpu->I, cpu_flag_z(cpu), cpu->C);
 }
 
 void inc_stack_ptr(CPU *cpu)
@@ -185,28 +265,46 @@ uint16_t stack_pop_word(CPU *cpu)
 	return result;
 }
 
-// This will read the whole file into an array of bytes...
-// maybe there is a smarter buffered way to do this
+// Maps the whole file read-only instead of copying it; release it with
+// free_file_bytes
 uint8_t *read_file_as_bytes(char *file_name, size_t *file_len)
 {
-	FILE *f = fopen(file_name, "rb");
-	if (f == NULL)
+	int fd = open(file_name, O_RDONLY);
+	if (fd == -1)
 	{
-		perror("fopen");
+		perror("open");
 		exit(1);
 	}
 
-	fseek(f, 0, SEEK_END);
-	*file_len = (size_t)ftell(f);
-	rewind(f);
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		perror("fstat");
+		exit(1);
+	}
 
-	uint8_t *buffer = malloc(*file_len);
-	fread(buffer, 1, *file_len, f);
-	fclose(f);
+	*file_len = (size_t)st.st_size;
+	uint8_t *buffer = NULL;
+	if (*file_len > 0)
+	{
+		buffer = mmap(NULL, *file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buffer == MAP_FAILED)
+		{
+			perror("mmap");
+			exit(1);
+		}
+	}
+	close(fd);
 
 	return buffer;
 }
 
+void free_file_bytes(uint8_t *buffer, size_t file_len)
+{
+	if (buffer != NULL)
+		munmap(buffer, file_len);
+}
+
 
 // 6502 assembler: https://www.masswerk.at/6502/assembler.html
 void run_program(CPU *cpu, FILE *logfile)
@@ -223,7 +321,7 @@ void run_program(CPU *cpu, FILE *logfile)
 
 		cpu->operand = 0x0000;
 
-		opcode = cpu->memory[cpu->PC];
+		opcode = cpu_read(cpu->nes, cpu->PC);
 		current_inst = &instruction_table[opcode];
 		cpu->current_inst = current_inst;
 
@@ -249,6 +347,16 @@ void run_program(CPU *cpu, FILE *logfile)
 	
 }
 
+// Stores only write to the effective address; reading it first would
+// trigger side effects on registers such as $2002 and $2007
+static uint8_t read_operand(CPU *cpu, uint16_t addr)
+{
+	void (*operation)(CPU *) = cpu->current_inst->operation;
+	if (operation == STA || operation == STX || operation == STY)
+		return 0x00;
+	return cpu_read(cpu->nes, addr);
+}
+
 /* 
 ADDRESSING MODES
 see: https://rosettacode.org/wiki/Category:6502_Assembly#Addressing_Modes
@@ -259,8 +367,6 @@ more: http://www.emulator101.com/6502-addressing-modes.html
 void implied(CPU *cpu)
 {
 	cpu->PC += 1;
-	
-	fprintf(stdout, "%s\n", cpu->current_inst->name);
 }
 
 // Operand is accumulator
@@ -269,8 +375,6 @@ void accumulator(CPU *cpu)
 	
 	cpu->operand = cpu->A;
 	cpu->PC += 1;
-
-	fprintf(stdout, "%s A\n", cpu->current_inst->name);
 }
 
 // The operand of an immediate instruction is only one byte, and denotes a constant value
@@ -279,18 +383,15 @@ void immediate(CPU *cpu)
 	cpu->operand = cpu_read(cpu->nes, cpu->PC + 1);
 	cpu->jmp_addr = cpu->operand;
 	cpu->PC += 2;
-
-	fprintf(stdout, "%s #$%02X\n", cpu->current_inst->name, cpu->operand);
 }
 
 // The operand of a zeropage instruction is one byte, and denotes an address in the zero page
 void zero_page(CPU *cpu)
 {
 	uint8_t value = cpu_read(cpu->nes, cpu->PC + 1);
-	fprintf(stdout, "%s $%02X\n", cpu->current_inst->name, value);
 
 	cpu->jmp_addr = (uint16_t)value & 0x00FF;
-	cpu->operand = cpu_read(cpu->nes, value);
+	cpu->operand = read_operand(cpu, value);
 	cpu->PC += 2;
 }
 
@@ -304,10 +405,8 @@ void absolute(CPU *cpu)
 
 	cpu->jmp_addr = addr;
 
-	cpu->operand = cpu_read(cpu->nes, addr);
+	cpu->operand = read_operand(cpu, addr);
 	cpu->PC += 3;
-
-	fprintf(stdout, "%s $%02X%02X\n", cpu->current_inst->name, big, little);
 }
 
 // Indirect: operand is address; effective address is contents of word at address
@@ -319,7 +418,6 @@ void indirect(CPU *cpu)
 	big = cpu_read(cpu->nes, cpu->PC + 2);
 	uint16_t addr = (uint16_t)big << 8 | little;
 
-	fprintf(stdout, "%s ($%02X%02X)\n", cpu->current_inst->name, big, little);
 	if (little == 0xFF)
 		big = cpu_read(cpu->nes, addr - 0xFF); // no carry bug
 	else  
@@ -327,7 +425,7 @@ void indirect(CPU *cpu)
 	little = cpu_read(cpu->nes, addr);
 
 	cpu->jmp_addr = (uint16_t)big << 8 | little;
-	cpu->operand = cpu_read(cpu->nes, cpu->jmp_addr);
+	cpu->operand = read_operand(cpu, cpu->jmp_addr);
 	cpu->PC += 3;
 }
 
@@ -340,30 +438,25 @@ void relative(CPU *cpu)
 	// cpu->jmp_addr = cpu->PC + (int8_t)offset;
 	// printf("%u = %u + %d   %u  %d\n", cpu->jmp_addr, cpu->PC, (int8_t)offset, offset, offset);
 	cpu->PC += 2;
-	fprintf(stdout, "%s $%04X\n", cpu->current_inst->name, cpu->PC + (int8_t)offset);
 }
 
 // A zero page memory address offset by X
 void zero_offset_x(CPU *cpu)
 {
-	fprintf(stdout, "%s $%02X,X\n", cpu->current_inst->name, cpu_read(cpu->nes, cpu->PC + 1));
-
 	uint8_t index = (cpu_read(cpu->nes, cpu->PC + 1) + cpu->X) % 256;
 	cpu->jmp_addr = (uint16_t)index & 0x00FF;	
-	cpu->operand = cpu_read(cpu->nes, index);
+	cpu->operand = read_operand(cpu, index);
 	cpu->PC += 2;
 }
 
 // A zero page memory address offset by Y
 void zero_offset_y(CPU *cpu)
 {
-	fprintf(stdout, "%s $%02X,Y\n", cpu->current_inst->name, cpu_read(cpu->nes, cpu->PC + 1));
-
 	uint8_t index = (cpu_read(cpu->nes, cpu->PC + 1) + cpu->Y) % 256;
 
 	cpu->jmp_addr = (uint16_t)index;
 
-	cpu->operand = cpu_read(cpu->nes, index);
+	cpu->operand = read_operand(cpu, index);
 	cpu->PC += 2;
 }
 
@@ -375,10 +468,8 @@ void abs_offset_x(CPU *cpu)
 	big = cpu_read(cpu->nes, cpu->PC + 2);
 	uint16_t addr = (uint16_t)big << 8 | little;
 
-	fprintf(stdout, "%s $%02X%02X,X\n", cpu->current_inst->name, little, big);
-
 	cpu->jmp_addr = addr + (uint16_t)cpu->X;
-	cpu->operand = cpu_read(cpu->nes, cpu->jmp_addr);
+	cpu->operand = read_operand(cpu, cpu->jmp_addr);
 	cpu->PC += 3;
 }
 
@@ -390,10 +481,8 @@ void abs_offset_y(CPU *cpu)
 	big = cpu_read(cpu->nes, cpu->PC + 2);
 	uint16_t addr = (uint16_t)big << 8 | little;
 
-	fprintf(stdout, "%s $%02X%02X,Y\n", cpu->current_inst->name, little, big);
-
 	cpu->jmp_addr = addr + (uint16_t)cpu->Y;
-	cpu->operand = cpu_read(cpu->nes, cpu->jmp_addr);
+	cpu->operand = read_operand(cpu, cpu->jmp_addr);
 	cpu->PC += 3;
 }
 
@@ -410,11 +499,9 @@ void zero_indirect_x(CPU *cpu)
 		big = cpu_read(cpu->nes, addr + 1);
 	uint16_t final_addr = (uint16_t)big << 8 | little;
 
-	fprintf(stdout, "%s ($%02X,X)\n", cpu->current_inst->name, cpu_read(cpu->nes, cpu->PC + 1));
-
 	cpu->jmp_addr = final_addr;
 
-	cpu->operand = cpu_read(cpu->nes, final_addr);
+	cpu->operand = read_operand(cpu, final_addr);
 	cpu->PC += 2;
 }
 
@@ -430,13 +517,9 @@ void zero_indirect_y(CPU *cpu)
 	
 	uint16_t addr = (uint16_t)big << 8 | little;
 
-
-	fprintf(stdout, "%s ($%02X),Y\n", cpu->current_inst->name, cpu_read(cpu->nes, cpu->PC + 1));	
-
 	cpu->jmp_addr = addr + ((uint16_t)cpu->Y & 0x00FF);
-	printf("%04X %04X\n", addr, cpu->jmp_addr);
 
-	cpu->operand = cpu_read(cpu->nes, cpu->jmp_addr);
+	cpu->operand = read_operand(cpu, cpu->jmp_addr);
 	cpu->PC += 2;
 }
 
@@ -445,16 +528,6 @@ void zero_indirect_y(CPU *cpu)
 // details: https://llx.com/Neil/a2/opcodes.html
 // more: http://www.emulator101.com/reference/6502-reference.html
 
-static uint8_t check_negative(uint8_t value)
-{
-	return value & 0x80 ? 1 : 0;
-}
-
-static uint8_t check_zero(uint8_t value)
-{
-	return value ? 0 : 1;
-}
-
 static uint8_t check_carry(uint8_t value)
 {
 	return value & 0x80 ? 1 : 0;
@@ -464,22 +537,19 @@ static uint8_t check_carry(uint8_t value)
 void ORA(CPU *cpu)
 {
 	cpu->A |= cpu->operand;
-	cpu->N = check_negative(cpu->A);
-	cpu->Z = check_zero(cpu->A);
+	cpu->nz_src = cpu->A;
 }
 
 void AND(CPU *cpu)
 {
 	cpu->A &= cpu->operand;
-	cpu->N = check_negative(cpu->A);
-	cpu->Z = check_zero(cpu->A);
+	cpu->nz_src = cpu->A;
 }
 
 void EOR(CPU *cpu)
 {
 	cpu->A ^= cpu->operand;
-	cpu->N = check_negative(cpu->A);
-	cpu->Z = check_zero(cpu->A);
+	cpu->nz_src = cpu->A;
 }
 
 
@@ -489,16 +559,15 @@ void ADC(CPU *cpu)
 {
 	uint16_t temp = (uint16_t)cpu->A + (uint16_t)cpu->operand + (uint16_t)cpu->C;
 	cpu->C = temp > 255 ? 1 : 0;
-	cpu->Z = (temp & 0x00FF) == 0 ? 1 : 0;
+	cpu->nz_src = temp & 0x00FF;
 
 	/*
 	The over flow is set if the two operands of the addition have the same sign, and the result has the opposite sign
 	so if the MSB of both operands is 1 and the MSB of the result (temp) is 0, or vice versa,
-	then the overflow flag is set. Notice that the final '&' here will result in 
-	0x80 if this is true on the left-hand side and it will be 0x00 otherwise.
+	then the overflow flag is set. Bit 7 of the expression is exactly that, so it
+	is stored as-is and only looked at when V is actually needed.
 	*/
-	cpu->V = (~((uint16_t)cpu->A ^ (uint16_t)cpu->operand) & ((uint16_t)cpu->A ^ (uint16_t)temp)) & 0x0080 ? 1 : 0;
-	cpu->N = temp & 0x80 ? 1 : 0;
+	cpu->v_src = ~(cpu->A ^ cpu->operand) & (cpu->A ^ (uint8_t)temp);
 
 	cpu->A = (uint8_t)(temp & 0x00FF);
 }
@@ -511,15 +580,13 @@ void STA(CPU *cpu)
 void LDA(CPU *cpu)
 {
 	cpu->A = cpu->operand;
-	cpu->Z = check_zero(cpu->A);
-	cpu->N = check_negative(cpu->A);
+	cpu->nz_src = cpu->A;
 }
 
 void CMP(CPU *cpu)
 {
 	uint16_t temp = (uint16_t)cpu->A - (uint16_t)cpu->operand;
-	cpu->N = temp & 0x0080 ? 1 : 0;
-	cpu->Z = check_zero(temp & 0x00FF);
+	cpu->nz_src = temp & 0x00FF;
 	cpu->C = (cpu->A >= cpu->operand) ? 1 : 0;
 }
 
@@ -542,8 +609,7 @@ void ASL(CPU *cpu)
 	else
 		cpu_write(cpu->nes, cpu->jmp_addr, temp);
 	cpu->C = check_carry(cpu->operand);
-	cpu->N = check_negative(temp);
-	cpu->Z = check_zero(temp);
+	cpu->nz_src = temp;
 }
 
 void ROL(CPU *cpu)
@@ -556,8 +622,7 @@ void ROL(CPU *cpu)
 	else
 		cpu_write(cpu->nes, cpu->jmp_addr, temp);
 
-	cpu->N = check_negative(temp);
-	cpu->Z = check_zero(temp);
+	cpu->nz_src = temp;
 }	
 
 void LSR(CPU *cpu)
@@ -568,8 +633,7 @@ void LSR(CPU *cpu)
 	else
 		cpu_write(cpu->nes, cpu->jmp_addr, temp);
 	cpu->C = cpu->operand & 0x01 ? 1 : 0;
-	cpu->N = 0;
-	cpu->Z = check_zero(temp);
+	cpu->nz_src = temp;
 }
 
 void ROR(CPU *cpu)
@@ -584,8 +648,7 @@ void ROR(CPU *cpu)
 	else
 		cpu_write(cpu->nes, cpu->jmp_addr, temp);
 
-	cpu->N = check_negative(temp);
-	cpu->Z = check_zero(temp);
+	cpu->nz_src = temp;
 }
 
 void STX(CPU *cpu)
@@ -596,34 +659,30 @@ void STX(CPU *cpu)
 void LDX(CPU *cpu)
 {
 	cpu->X = cpu->operand;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	cpu->nz_src = cpu->X;
 }
 
 void INC(CPU *cpu)
 {
 	cpu->operand++;
 	cpu_write(cpu->nes, cpu->jmp_addr, cpu->operand);
-	cpu->Z = check_zero(cpu->operand);
-	cpu->N = check_negative(cpu->operand);
+	cpu->nz_src = cpu->operand;
 }
 
 void DEC(CPU *cpu)
 {
 	cpu->operand--;
 	cpu_write(cpu->nes, cpu->jmp_addr, cpu->operand);
-	cpu->Z = check_zero(cpu->operand);
-	cpu->N = check_negative(cpu->operand);
+	cpu->nz_src = cpu->operand;
 }
 
 
 // group 3
 void BIT(CPU *cpu)
 {
-	printf("%02X %02X\n", cpu->operand, cpu->A);
-	cpu->Z = check_zero((cpu->operand & cpu->A) & 0x00FF);
-	cpu->V = cpu->operand & (1 << 6) ? 1 : 0;
-	cpu->N = cpu->operand & (1 << 7) ? 1 : 0;
+	// N and V come straight from the operand, Z from the AND with A
+	cpu->nz_src = ((cpu->operand & 0x80) << 1) | (cpu->operand & cpu->A);
+	cpu->v_src = cpu->operand << 1;
 }
 
 void JMP(CPU *cpu)
@@ -639,23 +698,20 @@ void STY(CPU *cpu)
 void LDY(CPU *cpu)
 {
 	cpu->Y = cpu->operand;
-	cpu->Z = check_zero(cpu->Y);
-	cpu->N = check_negative(cpu->Y);
+	cpu->nz_src = cpu->Y;
 }
 
 void CPY(CPU *cpu)
 {
 	uint16_t temp = (uint16_t)cpu->Y - (uint16_t)cpu->operand;
-	cpu->N = temp & 0x0080 ? 1 : 0;
-	cpu->Z = check_zero(temp & 0x00FF);
+	cpu->nz_src = temp & 0x00FF;
 	cpu->C = (cpu->Y >= cpu->operand) ? 1 : 0;
 }
 
 void CPX(CPU *cpu)
 {
 	uint16_t temp = (uint16_t)cpu->X - (uint16_t)cpu->operand;
-	cpu->N = temp & 0x0080 ? 1 : 0;
-	cpu->Z = check_zero(temp & 0x00FF);
+	cpu->nz_src = temp & 0x00FF;
 	cpu->C = (cpu->X >= cpu->operand) ? 1 : 0;
 }
 
@@ -663,25 +719,25 @@ void CPX(CPU *cpu)
 // conditional branches
 void BPL(CPU *cpu)
 {
-	if (!cpu->N)
+	if (!cpu_flag_n(cpu))
 		cpu->PC += (int8_t)cpu->operand;
 }
 
 void BMI(CPU *cpu)
 {
-	if (cpu->N)
+	if (cpu_flag_n(cpu))
 		cpu->PC += (int8_t)cpu->operand;
 }
 
 void BVC(CPU *cpu)
 {
-	if (!cpu->V)
+	if (!cpu_flag_v(cpu))
 		cpu->PC += (int8_t)cpu->operand;
 }
 
 void BVS(CPU *cpu)
 {
-	if (cpu->V)
+	if (cpu_flag_v(cpu))
 		cpu->PC += (int8_t)cpu->operand;
 }
 
@@ -699,13 +755,13 @@ void BCS(CPU *cpu)
 
 void BNE(CPU *cpu)
 {
-	if (!cpu->Z)
+	if (!cpu_flag_z(cpu))
 		cpu->PC += (int8_t)cpu->operand;
 }
 
 void BEQ(CPU *cpu)
 {
-	if (cpu->Z)
+	if (cpu_flag_z(cpu))
 		cpu->PC += (int8_t)cpu->operand;
 }
 
@@ -721,7 +777,7 @@ void BRK(CPU *cpu)
 
 	cpu->B = 0;
 
-	cpu->PC = ((uint16_t)cpu->memory[IRQ_LO]) | ((uint16_t)cpu->memory[IRQ_HI] << 8);
+	cpu->PC = ((uint16_t)cpu_read(cpu->nes, IRQ_LO)) | ((uint16_t)cpu_read(cpu->nes, IRQ_HI) << 8);
 }
 
 void JSR(CPU *cpu)
@@ -771,36 +827,31 @@ void PHA(CPU *cpu)
 void PLA(CPU *cpu)
 {
 	cpu->A = stack_pop(cpu);
-	cpu->Z = check_zero(cpu->A);
-	cpu->N = check_negative(cpu->A);
+	cpu->nz_src = cpu->A;
 }
 
 void DEY(CPU *cpu)
 {
 	cpu->Y--;
-	cpu->Z = check_zero(cpu->Y);
-	cpu->N = check_negative(cpu->Y);
+	cpu->nz_src = cpu->Y;
 }
 
 void TAY(CPU *cpu)
 {
 	cpu->Y = cpu->A;
-	cpu->Z = check_zero(cpu->Y);
-	cpu->N = check_negative(cpu->Y);
+	cpu->nz_src = cpu->Y;
 }
 
 void INY(CPU *cpu)
 {
 	cpu->Y++;
-	cpu->Z = check_zero(cpu->Y);
-	cpu->N = check_negative(cpu->Y);
+	cpu->nz_src = cpu->Y;
 }
 
 void INX(CPU *cpu)
 {
 	cpu->X++;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	cpu->nz_src = cpu->X;
 }	
 
 void CLC(CPU *cpu)
@@ -826,13 +877,12 @@ void SEI(CPU *cpu)
 void TYA(CPU *cpu)
 {
 	cpu->A = cpu->Y;
-	cpu->Z = check_zero(cpu->A);
-	cpu->N = check_negative(cpu->A);
+	cpu->nz_src = cpu->A;
 }
 
 void CLV(CPU *cpu)
 {
-	cpu->V = 0;
+	cpu->v_src = 0;
 }
 
 void CLD(CPU *cpu)
@@ -848,8 +898,7 @@ void SED(CPU *cpu)
 void TXA(CPU *cpu)
 {
 	cpu->A = cpu->X;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	cpu->nz_src = cpu->X;
 }
 
 void TXS(CPU *cpu)
@@ -860,22 +909,19 @@ void TXS(CPU *cpu)
 void TAX(CPU *cpu)
 {
 	cpu->X = cpu->A;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	cpu->nz_src = cpu->X;
 }
 
 void TSX(CPU *cpu)
 {
 	cpu->X = cpu->SP;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	cpu->nz_src = cpu->X;
 }
 
 void DEX(CPU *cpu)
 {
 	cpu->X--;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	cpu->nz_src = cpu->X;
 }
 
 void NOP(CPU *cpu)
@@ -886,19 +932,21 @@ void NOP(CPU *cpu)
 
 // Interrupts
 
-void IMP(CPU *cpu)
+void IRQ(CPU *cpu)
 {
 	if (cpu->I == 0)
 	{
 		stack_push_word(cpu, cpu->PC);
 
+		// the copy on the stack keeps the I flag from before, so RTI
+		// unmasks interrupts again
 		cpu->B = 0;
 		cpu->U = 1;
-		cpu->I = 1;
 		stack_push(cpu, get_flags(cpu));
+		cpu->I = 1;
 
-		uint16_t little = cpu->memory[IRQ_LO];
-		uint8_t  big    = cpu->memory[IRQ_HI];
+		uint16_t little = cpu_read(cpu->nes, IRQ_LO);
+		uint8_t  big    = cpu_read(cpu->nes, IRQ_HI);
 		cpu->PC = little | (big << 8);
 
 		cpu->current_cycles += 7;
@@ -911,13 +959,15 @@ void NMI(CPU *cpu)
 {
 		stack_push_word(cpu, cpu->PC);
 
+		// the copy on the stack keeps the I flag from before, so RTI
+		// unmasks interrupts again
 		cpu->B = 0;
 		cpu->U = 1;
-		cpu->I = 1;
 		stack_push(cpu, get_flags(cpu));
+		cpu->I = 1;
 
-		uint16_t little = cpu->memory[NMI_LO];
-		uint8_t  big    = cpu->memory[NMI_HI];
+		uint16_t little = cpu_read(cpu->nes, NMI_LO);
+		uint8_t  big    = cpu_read(cpu->nes, NMI_HI);
 		cpu->PC = little | (big << 8);
 
 		cpu->current_cycles += 8;
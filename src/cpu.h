@@ -2,12 +2,11 @@
 #define _CPU_6502_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define BYTES_PER_PAGE 256
-#define PAGES          256
-#define ADDRESS_BYTES  BYTES_PER_PAGE*PAGES
+#define RAM_BYTES      0x0800
 
 struct NES;
 struct CPU;
@@ -20,12 +19,57 @@ typedef struct Instruction
 	uint8_t clock_cycles;
 } Instruction;
 
+extern Instruction instruction_table[256];
 
-typedef struct CPU
+// Fixed-size snapshot of the CPU taken right before an instruction executes.
+// Only produced when built with -DNES_TRACE; decoded offline by trace.c
+typedef struct TraceRecord
+{
+	uint16_t PC;
+	uint8_t  opcode;
+	uint8_t  operands[2];
+	uint8_t  A;
+	uint8_t  X;
+	uint8_t  Y;
+	uint8_t  P;
+	uint8_t  SP;
+	uint32_t cycle;
+} TraceRecord;
+
+typedef void (*TraceHook)(void *, const TraceRecord *);
+
+// Interpreter used by clock_cpu. The table core dispatches through
+// instruction_table and is kept as the reference implementation. The block
+// core runs the fused handlers over pre-decoded runs of PRG ROM code, and the
+// JIT core additionally translates hot runs into x86-64 code
+typedef enum CpuCore
+{
+	CPU_CORE_TABLE,
+	CPU_CORE_FUSED,
+	CPU_CORE_BLOCK,
+	CPU_CORE_JIT
+} CpuCore;
+
+#define BLOCK_MAX_OPS  16  // instructions per decoded block
+
+// An instruction with its operand bytes already fetched
+typedef struct DecodedOp
 {
-	// 64 KiB memory (RAM + ROM)
-	uint8_t memory[ADDRESS_BYTES];
+	uint16_t operand;    // lo | hi << 8, zero-extended for shorter instructions
+	uint8_t  opcode;
+	uint8_t  length;
+	uint8_t  cycles;
+} DecodedOp;
+
+typedef void (*FusedHandler)(struct CPU *, uint16_t);
+extern const FusedHandler fused_handlers[256];
+
+struct BlockCache;
+struct JitCode;
+
 
+typedef struct CPU
+{
 	// registers
 	// described here: https://codebase64.org/doku.php?id=base:6502_registers
 	uint16_t PC;         // program counter
@@ -34,15 +78,17 @@ typedef struct CPU
 	uint8_t  Y;          // index register y
 	uint8_t  SP;         // stack pointer
 
-	// processor flags 
-	unsigned int N : 1;  // 7 negative
-	unsigned int V : 1;  // 6 overflow
-	unsigned int U : 1;  // 5 UNUSED (always set to 1)
-	unsigned int B : 1;  // 4 break
-	unsigned int D : 1;  // 3 decimal mode
-	unsigned int I : 1;  // 2 interrupt disable
-	unsigned int Z : 1;  // 1 zero
-	unsigned int C : 1;  // 0 carry
+	// processor flags
+	// N, Z and V are evaluated lazily: instructions only store the value the
+	// flags derive from and cpu_flag_n/z/v() work them out when a branch,
+	// PHP, BRK, an interrupt or a dump actually asks. The others are 0 or 1
+	uint16_t nz_src;     // 7 negative: bit 7 or 8 set, 1 zero: low byte is 0
+	uint8_t  v_src;      // 6 overflow: bit 7
+	uint8_t  U;          // 5 UNUSED (always set to 1)
+	uint8_t  B;          // 4 break
+	uint8_t  D;          // 3 decimal mode
+	uint8_t  I;          // 2 interrupt disable
+	uint8_t  C;          // 0 carry
 
 	// instruction execution
 	Instruction *current_inst;
@@ -50,19 +96,64 @@ typedef struct CPU
 	uint16_t jmp_addr;
 
 	// clock
+	CpuCore  core;
 	uint8_t  current_cycles;
-	uint32_t total_cycles;
+	uint64_t total_cycles;
+	bool     stop;       // set by a write that changes when the next interrupt is due; ends cpu_run early
 
 	// reference to system for communication
 	struct NES *nes;
 
+	// decoded PRG ROM code for CPU_CORE_BLOCK, allocated on first use
+	struct BlockCache *blocks;
+	struct JitCode *jit;
+
+	// instruction tracer, only called in -DNES_TRACE builds
+	TraceHook tracer;
+	void *tracer_ctx;
+
+	// 2 KiB internal RAM ($0000-$07FF, mirrored up to $1FFF). Everything
+	// else, including the interrupt vectors, is reached over the bus
+	uint8_t ram[RAM_BYTES];
+
 } CPU;
 
+static inline uint8_t cpu_flag_n(const CPU *cpu) { return (cpu->nz_src & 0x180) ? 1 : 0; }
+static inline uint8_t cpu_flag_z(const CPU *cpu) { return (cpu->nz_src & 0x0FF) ? 0 : 1; }
+static inline uint8_t cpu_flag_v(const CPU *cpu) { return cpu->v_src >> 7; }
+
+// Sets N and Z independently of each other (PLP, RTI). Bit 8 carries N
+// so that N and Z can both be set, which no ALU result can produce
+static inline void cpu_set_nz(CPU *cpu, int n, int z)
+{
+	cpu->nz_src = (n ? 0x100 : 0) | (z ? 0 : 1);
+}
+
 CPU *init_cpu();
 void clock_cpu(CPU *);
+void cpu_step(CPU *);
+void cpu_run(CPU *, uint64_t);
 void reset_cpu(CPU *);
 void delete_cpu(CPU *);
 void connect_system(CPU *, struct NES *);
+void cpu_set_tracer(CPU *, TraceHook, void *);
+uint8_t instruction_length(const Instruction *);
+void run_next_instruction_fused(CPU *);
+int fused_execute(CPU *, const DecodedOp *, int, uint64_t);
+void fused_decode(DecodedOp *, uint8_t, uint8_t, uint8_t);
+struct BlockCache *block_cache_create();
+void block_cache_delete(struct BlockCache *);
+void run_blocks(CPU *, uint64_t);
+
+typedef void (*JitBlock)(struct CPU *, uint64_t);
+struct JitCode *jit_create();
+void jit_delete(struct JitCode *);
+JitBlock jit_compile(struct JitCode *, const DecodedOp *, int, uint8_t *const *, const uint8_t *);
+int jit_full(const struct JitCode *);
+void jit_reset(struct JitCode *);
+#ifdef NES_TRACE
+void cpu_trace_instruction(CPU *, uint8_t);
+#endif
 uint8_t get_flags(CPU *);
 void set_flags(CPU *, uint8_t);
 void dump_cpu(CPU *, FILE *);
@@ -74,6 +165,7 @@ void stack_push_word(CPU *, uint16_t);
 uint16_t stack_pop_word(CPU *);
 
 uint8_t *read_file_as_bytes(char *, size_t *);
+void free_file_bytes(uint8_t *, size_t);
 void run_program(CPU *, FILE *);
 
 // Address modes
@@ -149,7 +241,7 @@ void TSX(CPU *);
 void DEX(CPU *);
 void NOP(CPU *);
 
-void IMP(CPU *);
+void IRQ(CPU *);
 void NMI(CPU *);
 
 #endif
\ No newline at end of file
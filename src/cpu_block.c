@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "cpu.h"
+#include "nes.h"
+
+/*
+Block cache for the fused handlers.
+
+Straight-line runs of PRG ROM code are decoded once into DecodedOps and
+then executed back to back by fused_execute, so the opcode and operand
+bytes are no longer fetched through cpu_read on every instruction.
+
+A block never crosses a 256 byte page and is tagged with the host
+address it was decoded from (read_map page + offset). A bank switch
+changes read_map, so stale blocks simply stop matching and get decoded
+again; there is nothing to flush. Only pages that are mapped read-only are
+cached. Code running from RAM (or anything else that is writable or
+behind an I/O handler) goes through the plain fused core instead, which
+keeps self-modifying code correct without write tracking.
+
+With the JIT core, blocks that keep getting run are also handed to
+cpu_jit.c and from then on run as native code.
+*/
+
+#define BLOCK_CACHE_SIZE 4096  // direct mapped by PC
+#define JIT_HOT_RUNS     16    // interpreted runs before a block is translated
+
+typedef struct Block
+{
+	const uint8_t *host;  // where the first opcode lives, NULL when unused
+	int count;
+	int runs;             // JIT core: times run by the interpreter
+	JitBlock native;      // JIT core: translated code, if any
+	uint8_t native_page;  // CPU page whose read_map slot the native code checks
+	DecodedOp ops[BLOCK_MAX_OPS];
+} Block;
+
+struct BlockCache
+{
+	Block blocks[BLOCK_CACHE_SIZE];
+};
+
+struct BlockCache *block_cache_create()
+{
+	struct BlockCache *cache = calloc(1, sizeof(struct BlockCache));
+	if (cache == NULL) {
+		perror("Allocating block cache");
+		exit(EXIT_FAILURE);
+	}
+	return cache;
+}
+
+void block_cache_delete(struct BlockCache *cache)
+{
+	free(cache);
+}
+
+// Anything that can move PC somewhere other than the next instruction
+static int ends_block(const Instruction *inst)
+{
+	void (*op)(CPU *) = inst->operation;
+
+	return inst->addr_mode == relative || op == JMP || op == JSR || op == RTS || op == RTI || op == BRK;
+}
+
+// Decodes from `host` (the byte at `offset` in its page) up to the first
+// control flow instruction, the end of the page or BLOCK_MAX_OPS
+static void decode_block(Block *block, const uint8_t *host, uint16_t offset)
+{
+	block->host = host;
+	block->count = 0;
+	block->runs = 0;
+	block->native = NULL;
+
+	while (block->count < BLOCK_MAX_OPS)
+	{
+		uint8_t opcode = host[0];
+		uint8_t length = instruction_length(&instruction_table[opcode]);
+
+		if (offset + length > 0x100)
+			break;
+
+		fused_decode(&block->ops[block->count++], opcode,
+			         length > 1 ? host[1] : 0x00, length > 2 ? host[2] : 0x00);
+
+		if (ends_block(&instruction_table[opcode]))
+			break;
+		host += length;
+		offset += length;
+	}
+}
+
+// Hands a hot block to the JIT. When the code buffer is full all native
+// code is thrown away and blocks have to get hot again
+static void translate_block(CPU *cpu, Block *block, const uint8_t *page, uint8_t *const *slot)
+{
+	if (jit_full(cpu->jit)) {
+		Block *blocks = cpu->blocks->blocks;
+		for (size_t i = 0; i < BLOCK_CACHE_SIZE; i++)
+		{
+			blocks[i].native = NULL;
+			blocks[i].runs = 0;
+		}
+		jit_reset(cpu->jit);
+		return;
+	}
+
+	block->native = jit_compile(cpu->jit, block->ops, block->count, slot, page);
+	block->native_page = (uint8_t)(slot - cpu->nes->read_map);
+}
+
+void run_blocks(CPU *cpu, uint64_t until)
+{
+	NES *nes = cpu->nes;
+	Block *blocks = cpu->blocks->blocks;
+
+	while (cpu->total_cycles < until && !cpu->stop)
+	{
+		uint16_t pc = cpu->PC;
+		uint8_t page = pc >> 8;
+		const uint8_t *host = nes->read_map[page];
+
+		if (host == NULL || nes->write_map[page] != NULL) {
+			run_next_instruction_fused(cpu);
+			continue;
+		}
+
+		host += pc & 0xFF;
+		Block *block = &blocks[pc & (BLOCK_CACHE_SIZE - 1)];
+		if (block->host != host)
+			decode_block(block, host, pc & 0xFF);
+
+		// an instruction straddling the page end is left to the fused core.
+		// The same bank mapped at another CPU page finds the same block, but
+		// its native code checks the other page's slot after writes, so it
+		// is only used at the page it was translated for
+		if (block->count == 0)
+			run_next_instruction_fused(cpu);
+		else if (block->native != NULL && block->native_page == page)
+			block->native(cpu, until);
+		else {
+			if (cpu->jit != NULL && ++block->runs == JIT_HOT_RUNS)
+				translate_block(cpu, block, nes->read_map[page], &nes->read_map[page]);
+			fused_execute(cpu, block->ops, block->count, until);
+		}
+	}
+	cpu->current_cycles = 0;
+}
@@ -0,0 +1,333 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "cpu.h"
+#include "nes.h"
+#include "opcodes.h"
+
+/*
+Fused interpreter core.
+
+Every opcode in OPCODE_TABLE is expanded into a single handler that does
+its addressing and its operation inline, so an instruction costs one
+indirect jump instead of two indirect calls, and the effective address
+and operand stay in locals rather than going through cpu->operand and
+cpu->jmp_addr. With GCC/Clang the handlers are dispatched with computed
+goto, otherwise with a plain switch.
+
+The handlers run from pre-decoded DecodedOps: one at a time, fetched
+over the bus, for the fused core, or whole straight-line runs out of the
+block cache in cpu_block.c.
+
+Behaviour (including cycle counts) matches the table core in cpu.c,
+which remains the reference implementation.
+*/
+
+#define READ(a)     cpu_read(cpu->nes, (a))
+#define WRITE(a, v) cpu_write(cpu->nes, (a), (v))
+
+// N and Z are lazy, see cpu.h
+#define SET_NZ(v) cpu->nz_src = (uint8_t)(v)
+
+// Addressing modes: PC has already been moved past the instruction, `lo`
+// and `hi` hold its operand bytes and `addr` receives the effective address
+#define AM_XXX
+#define AM_implied
+#define AM_accumulator
+#define AM_immediate
+#define AM_zero_page      addr = lo;
+#define AM_zero_offset_x  addr = (uint8_t)(lo + cpu->X);
+#define AM_zero_offset_y  addr = (uint8_t)(lo + cpu->Y);
+#define AM_absolute       addr = (uint16_t)hi << 8 | lo;
+#define AM_abs_offset_x   addr = ((uint16_t)hi << 8 | lo) + cpu->X;
+#define AM_abs_offset_y   addr = ((uint16_t)hi << 8 | lo) + cpu->Y;
+#define AM_relative       addr = cpu->PC + (int8_t)lo;
+#define AM_indirect \
+	{ \
+		uint16_t ptr = (uint16_t)hi << 8 | lo; \
+		/* no carry bug: the high byte is fetched from the same page */ \
+		addr = READ(ptr) | (uint16_t)READ((ptr & 0xFF00) | ((ptr + 1) & 0x00FF)) << 8; \
+	}
+#define AM_zero_indirect_x \
+	{ \
+		uint8_t zp = lo + cpu->X; \
+		addr = READ(zp) | (uint16_t)READ((uint8_t)(zp + 1)) << 8; \
+	}
+#define AM_zero_indirect_y \
+	{ \
+		uint16_t base = READ(lo) | (uint16_t)READ((uint8_t)(lo + 1)) << 8; \
+		addr = base + cpu->Y; \
+	}
+
+// Operand access, resolved per addressing mode at compile time
+#define LOAD(mode)          LOAD_##mode
+#define LOAD_immediate      (lo)
+#define LOAD_accumulator    (cpu->A)
+#define LOAD_zero_page      READ(addr)
+#define LOAD_zero_offset_x  READ(addr)
+#define LOAD_zero_offset_y  READ(addr)
+#define LOAD_absolute       READ(addr)
+#define LOAD_abs_offset_x   READ(addr)
+#define LOAD_abs_offset_y   READ(addr)
+#define LOAD_zero_indirect_x READ(addr)
+#define LOAD_zero_indirect_y READ(addr)
+
+#define STORE(mode, v)           STORE_##mode(v)
+#define STORE_accumulator(v)     cpu->A = (v)
+#define STORE_zero_page(v)       WRITE(addr, v)
+#define STORE_zero_offset_x(v)   WRITE(addr, v)
+#define STORE_zero_offset_y(v)   WRITE(addr, v)
+#define STORE_absolute(v)        WRITE(addr, v)
+#define STORE_abs_offset_x(v)    WRITE(addr, v)
+#define STORE_abs_offset_y(v)    WRITE(addr, v)
+#define STORE_zero_indirect_x(v) WRITE(addr, v)
+#define STORE_zero_indirect_y(v) WRITE(addr, v)
+
+// See ADC in cpu.c for the overflow derivation
+#define DO_ADC(value) \
+	{ \
+		uint8_t v = (value); \
+		uint16_t temp = (uint16_t)cpu->A + v + cpu->C; \
+		cpu->C = temp > 255 ? 1 : 0; \
+		cpu->v_src = ~(cpu->A ^ v) & (cpu->A ^ (uint8_t)temp); \
+		cpu->A = (uint8_t)temp; \
+		SET_NZ(cpu->A); \
+	}
+
+#define DO_COMPARE(reg, value) \
+	{ \
+		uint8_t v = (value); \
+		uint8_t temp = (reg) - v; \
+		SET_NZ(temp); \
+		cpu->C = (reg) >= v ? 1 : 0; \
+	}
+
+#define BRANCH(cond) if (cond) cpu->PC = addr;
+
+// Operations
+#define OP_XXX(mode)
+#define OP_ORA(mode) { cpu->A |= LOAD(mode); SET_NZ(cpu->A); }
+#define OP_AND(mode) { cpu->A &= LOAD(mode); SET_NZ(cpu->A); }
+#define OP_EOR(mode) { cpu->A ^= LOAD(mode); SET_NZ(cpu->A); }
+#define OP_ADC(mode) DO_ADC(LOAD(mode))
+#define OP_SBC(mode) DO_ADC(LOAD(mode) ^ 0xFF)
+#define OP_CMP(mode) DO_COMPARE(cpu->A, LOAD(mode))
+#define OP_CPX(mode) DO_COMPARE(cpu->X, LOAD(mode))
+#define OP_CPY(mode) DO_COMPARE(cpu->Y, LOAD(mode))
+#define OP_LDA(mode) { cpu->A = LOAD(mode); SET_NZ(cpu->A); }
+#define OP_LDX(mode) { cpu->X = LOAD(mode); SET_NZ(cpu->X); }
+#define OP_LDY(mode) { cpu->Y = LOAD(mode); SET_NZ(cpu->Y); }
+#define OP_STA(mode) WRITE(addr, cpu->A);
+#define OP_STX(mode) WRITE(addr, cpu->X);
+#define OP_STY(mode) WRITE(addr, cpu->Y);
+#define OP_ASL(mode) \
+	{ \
+		uint8_t v = LOAD(mode); \
+		uint8_t temp = v << 1; \
+		STORE(mode, temp); \
+		cpu->C = v >> 7; \
+		SET_NZ(temp); \
+	}
+#define OP_ROL(mode) \
+	{ \
+		uint8_t v = LOAD(mode); \
+		uint8_t temp = (v << 1) | cpu->C; \
+		cpu->C = v >> 7; \
+		STORE(mode, temp); \
+		SET_NZ(temp); \
+	}
+#define OP_LSR(mode) \
+	{ \
+		uint8_t v = LOAD(mode); \
+		uint8_t temp = v >> 1; \
+		STORE(mode, temp); \
+		cpu->C = v & 0x01; \
+		SET_NZ(temp); \
+	}
+#define OP_ROR(mode) \
+	{ \
+		uint8_t v = LOAD(mode); \
+		uint8_t temp = (v >> 1) | (cpu->C << 7); \
+		cpu->C = v & 0x01; \
+		STORE(mode, temp); \
+		SET_NZ(temp); \
+	}
+#define OP_INC(mode) { uint8_t v = LOAD(mode) + 1; WRITE(addr, v); SET_NZ(v); }
+#define OP_DEC(mode) { uint8_t v = LOAD(mode) - 1; WRITE(addr, v); SET_NZ(v); }
+#define OP_BIT(mode) \
+	{ \
+		uint8_t v = LOAD(mode); \
+		cpu->nz_src = ((v & 0x80) << 1) | (v & cpu->A); \
+		cpu->v_src = v << 1; \
+	}
+#define OP_JMP(mode) cpu->PC = addr;
+#define OP_BPL(mode) BRANCH(!cpu_flag_n(cpu))
+#define OP_BMI(mode) BRANCH(cpu_flag_n(cpu))
+#define OP_BVC(mode) BRANCH(!cpu_flag_v(cpu))
+#define OP_BVS(mode) BRANCH(cpu_flag_v(cpu))
+#define OP_BCC(mode) BRANCH(!cpu->C)
+#define OP_BCS(mode) BRANCH(cpu->C)
+#define OP_BNE(mode) BRANCH(!cpu_flag_z(cpu))
+#define OP_BEQ(mode) BRANCH(cpu_flag_z(cpu))
+#define OP_BRK(mode) BRK(cpu);
+#define OP_JSR(mode) { stack_push_word(cpu, cpu->PC - 1); cpu->PC = addr; }
+#define OP_RTI(mode) RTI(cpu);
+#define OP_RTS(mode) { cpu->PC = stack_pop_word(cpu) + 1; }
+#define OP_PHP(mode) PHP(cpu);
+#define OP_PLP(mode) PLP(cpu);
+#define OP_PHA(mode) stack_push(cpu, cpu->A);
+#define OP_PLA(mode) { cpu->A = stack_pop(cpu); SET_NZ(cpu->A); }
+#define OP_DEY(mode) { cpu->Y--; SET_NZ(cpu->Y); }
+#define OP_INY(mode) { cpu->Y++; SET_NZ(cpu->Y); }
+#define OP_DEX(mode) { cpu->X--; SET_NZ(cpu->X); }
+#define OP_INX(mode) { cpu->X++; SET_NZ(cpu->X); }
+#define OP_TAY(mode) { cpu->Y = cpu->A; SET_NZ(cpu->Y); }
+#define OP_TYA(mode) { cpu->A = cpu->Y; SET_NZ(cpu->A); }
+#define OP_TAX(mode) { cpu->X = cpu->A; SET_NZ(cpu->X); }
+#define OP_TXA(mode) { cpu->A = cpu->X; SET_NZ(cpu->A); }
+#define OP_TSX(mode) { cpu->X = cpu->SP; SET_NZ(cpu->X); }
+#define OP_TXS(mode) cpu->SP = cpu->X;
+#define OP_CLC(mode) cpu->C = 0;
+#define OP_SEC(mode) cpu->C = 1;
+#define OP_CLI(mode) cpu->I = 0;
+#define OP_SEI(mode) cpu->I = 1;
+#define OP_CLV(mode) cpu->v_src = 0;
+#define OP_CLD(mode) cpu->D = 0;
+#define OP_SED(mode) cpu->D = 1;
+#define OP_NOP(mode)
+
+// Instruction lengths, used to advance PC before the handler runs
+#define LEN_XXX             1
+#define LEN_implied         1
+#define LEN_accumulator     1
+#define LEN_immediate       2
+#define LEN_zero_page       2
+#define LEN_zero_offset_x   2
+#define LEN_zero_offset_y   2
+#define LEN_relative        2
+#define LEN_zero_indirect_x 2
+#define LEN_zero_indirect_y 2
+#define LEN_absolute        3
+#define LEN_abs_offset_x    3
+#define LEN_abs_offset_y    3
+#define LEN_indirect        3
+
+#define LENGTH_ENTRY(opcode, operation, addr_mode, cycles) [opcode] = LEN_##addr_mode,
+static const uint8_t opcode_length[256] = { OPCODE_TABLE(LENGTH_ENTRY) };
+#undef LENGTH_ENTRY
+
+#define CYCLES_ENTRY(opcode, operation, addr_mode, cycles) [opcode] = cycles,
+static const uint8_t opcode_cycles[256] = { OPCODE_TABLE(CYCLES_ENTRY) };
+#undef CYCLES_ENTRY
+
+#define HANDLER_BODY(operation, addr_mode) { AM_##addr_mode OP_##operation(addr_mode) }
+
+// Runs up to `count` pre-decoded instructions starting at cpu->PC. Stops
+// early once total_cycles reaches `until`, when a write remapped the page
+// the instructions were decoded from (a bank switch under our feet), or
+// when the CPU was told to stop.
+// Returns the number of instructions executed
+int fused_execute(CPU *cpu, const DecodedOp *op, int count, uint64_t until)
+{
+	uint8_t *const *slot = &cpu->nes->read_map[cpu->PC >> 8];
+	const uint8_t *page = *slot;
+	const DecodedOp *end = op + count;
+	uint8_t lo, hi;
+	uint16_t addr;
+
+#if defined(__GNUC__)
+	#define LABEL_ENTRY(opcode, operation, addr_mode, cycles) [opcode] = &&op_##opcode,
+	static void *dispatch[256] = { OPCODE_TABLE(LABEL_ENTRY) };
+	#undef LABEL_ENTRY
+#endif
+
+next:
+	lo = (uint8_t)op->operand;
+	hi = (uint8_t)(op->operand >> 8);
+	addr = 0x0000;
+
+#ifdef NES_TRACE
+	if (cpu->tracer != NULL)
+		cpu_trace_instruction(cpu, op->opcode);
+#endif
+
+	cpu->PC += op->length;
+
+#if defined(__GNUC__)
+	goto *dispatch[op->opcode];
+
+	#define HANDLER(opcode, operation, addr_mode, cycles) \
+		op_##opcode: HANDLER_BODY(operation, addr_mode) goto done;
+	OPCODE_TABLE(HANDLER)
+	#undef HANDLER
+done:
+#else
+	switch (op->opcode)
+	{
+	#define HANDLER(opcode, operation, addr_mode, cycles) \
+		case opcode: HANDLER_BODY(operation, addr_mode) break;
+		OPCODE_TABLE(HANDLER)
+	#undef HANDLER
+	}
+#endif
+	(void)lo;
+	(void)hi;
+	(void)addr;
+
+	// total_cycles is only advanced once the instruction is done, so bus
+	// accesses made by it see the cycle the instruction started on
+	cpu->total_cycles += op->cycles;
+
+	if (++op == end || cpu->total_cycles >= until || *slot != page || cpu->stop)
+		return (int)(count - (end - op));
+	goto next;
+}
+
+// The same handlers as standalone functions taking the operand word, for
+// code that calls them one by one (the JIT in cpu_jit.c). They move PC past
+// the instruction but leave the cycle count to the caller
+#define FUNCTION_HANDLER(opcode, operation, addr_mode, cycles) \
+	static void handler_##opcode(CPU *cpu, uint16_t operand) \
+	{ \
+		uint8_t lo = (uint8_t)operand; \
+		uint8_t hi = (uint8_t)(operand >> 8); \
+		uint16_t addr = 0x0000; \
+		TRACE_HANDLER(opcode) \
+		cpu->PC += LEN_##addr_mode; \
+		HANDLER_BODY(operation, addr_mode) \
+		(void)lo; \
+		(void)hi; \
+		(void)addr; \
+	}
+#ifdef NES_TRACE
+#define TRACE_HANDLER(opcode) if (cpu->tracer != NULL) cpu_trace_instruction(cpu, opcode);
+#else
+#define TRACE_HANDLER(opcode)
+#endif
+OPCODE_TABLE(FUNCTION_HANDLER)
+#undef TRACE_HANDLER
+#undef FUNCTION_HANDLER
+
+#define FUNCTION_ENTRY(opcode, operation, addr_mode, cycles) [opcode] = handler_##opcode,
+const FusedHandler fused_handlers[256] = { OPCODE_TABLE(FUNCTION_ENTRY) };
+#undef FUNCTION_ENTRY
+
+void fused_decode(DecodedOp *op, uint8_t opcode, uint8_t lo, uint8_t hi)
+{
+	op->opcode = opcode;
+	op->length = opcode_length[opcode];
+	op->cycles = opcode_cycles[opcode];
+	op->operand = op->length > 2 ? (uint16_t)hi << 8 | lo : op->length > 1 ? lo : 0x0000;
+}
+
+void run_next_instruction_fused(CPU *cpu)
+{
+	uint16_t pc = cpu->PC;
+	uint8_t opcode = READ(pc);
+	uint8_t length = opcode_length[opcode];
+	DecodedOp op;
+
+	fused_decode(&op, opcode, length > 1 ? READ(pc + 1) : 0x00, length > 2 ? READ(pc + 2) : 0x00);
+	fused_execute(cpu, &op, 1, UINT64_MAX);
+	cpu->current_cycles += op.cycles;
+}
@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include "cpu.h"
+
+/*
+x86-64 translator for hot blocks of the block core.
+
+A block is turned into a native function `void f(CPU *cpu, uint64_t until)`
+that calls the fused handler of each instruction in turn, with the
+operand word as an immediate, so there is no fetch, decode or dispatch
+left. A few simple register and flag instructions are emitted inline.
+
+After every instruction the native code adds its cycles to total_cycles
+and leaves once `until` is reached, exactly like fused_execute, so the
+scheduler sees the same instruction boundaries as with the interpreters.
+Instructions that can write memory are followed by a check that the page
+the block came from is still mapped (a bank switch ends the block) and
+that the write didn't ask the CPU to stop.
+
+Translation stops in front of absolute, abs,X and abs,Y operands in the
+PPU/APU/IO range ($2000-$401F): those instructions, and whatever follows
+them in the block, are left to the fused interpreter. This only keeps
+code that obviously drives the hardware out of native blocks; it is not
+needed for timing. Indexed or indirect accesses that end up on a register
+(STA $1FF8,X, STA ($nn),Y) stay in native code, which is fine because the
+handlers reach I/O through cpu_read/cpu_write, whose slow path catches
+the PPU up, and the write check above sees any stop it asks for.
+
+Only built for x86-64 on systems with mmap; elsewhere jit_create()
+returns NULL and the caller falls back to the interpreters.
+*/
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_CODE_BYTES  (4 << 20)
+#define JIT_BLOCK_BYTES 2048  // more than any BLOCK_MAX_OPS block needs
+
+struct JitCode
+{
+	uint8_t *code;
+	size_t used;
+};
+
+struct JitCode *jit_create()
+{
+	struct JitCode *jit = calloc(1, sizeof(struct JitCode));
+	if (jit == NULL) {
+		perror("Allocating JIT");
+		exit(EXIT_FAILURE);
+	}
+
+	jit->code = mmap(NULL, JIT_CODE_BYTES, PROT_READ | PROT_WRITE | PROT_EXEC,
+		             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		free(jit);
+		return NULL;
+	}
+	return jit;
+}
+
+void jit_delete(struct JitCode *jit)
+{
+	munmap(jit->code, JIT_CODE_BYTES);
+	free(jit);
+}
+
+int jit_full(const struct JitCode *jit)
+{
+	return jit->used + JIT_BLOCK_BYTES > JIT_CODE_BYTES;
+}
+
+// Drops all generated code; the caller forgets every JitBlock it holds
+void jit_reset(struct JitCode *jit)
+{
+	jit->used = 0;
+}
+
+// Emitter. rbx holds the CPU pointer and r12 the `until` cycle for the
+// whole block, both callee-saved so they survive the handler calls
+typedef struct Emitter
+{
+	uint8_t *p;
+} Emitter;
+
+static void emit8(Emitter *e, uint8_t b) { *e->p++ = b; }
+
+static void emit16(Emitter *e, uint16_t v)
+{
+	emit8(e, v & 0xFF);
+	emit8(e, v >> 8);
+}
+
+static void emit32(Emitter *e, uint32_t v)
+{
+	emit16(e, v & 0xFFFF);
+	emit16(e, v >> 16);
+}
+
+static void emit64(Emitter *e, uint64_t v)
+{
+	emit32(e, (uint32_t)v);
+	emit32(e, (uint32_t)(v >> 32));
+}
+
+static void emit_bytes(Emitter *e, const uint8_t *bytes, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		emit8(e, bytes[i]);
+}
+
+// <opcode bytes> [rbx + disp32]
+static void emit_rbx_mem(Emitter *e, const uint8_t *opcode, size_t n, uint8_t reg, size_t offset)
+{
+	emit_bytes(e, opcode, n);
+	emit8(e, 0x80 | (reg & 7) << 3 | 3);  // mod=10 rm=rbx
+	emit32(e, (uint32_t)offset);
+}
+
+// jcc rel32 to be patched to the exit; returns the address of rel32
+static uint8_t *emit_jcc(Emitter *e, uint8_t cc)
+{
+	emit8(e, 0x0F);
+	emit8(e, cc);
+	uint8_t *rel = e->p;
+	emit32(e, 0);
+	return rel;
+}
+
+#define JCC_AE 0x83
+#define JCC_NE 0x85
+
+// add word [rbx + PC], len
+static void emit_advance_pc(Emitter *e, uint8_t length)
+{
+	emit_rbx_mem(e, (const uint8_t[]){ 0x66, 0x83 }, 2, 0, offsetof(CPU, PC));
+	emit8(e, length);
+}
+
+// mov byte [rbx + offset], imm8
+static void emit_store_imm8(Emitter *e, size_t offset, uint8_t value)
+{
+	emit_rbx_mem(e, (const uint8_t[]){ 0xC6 }, 1, 0, offset);
+	emit8(e, value);
+}
+
+// movzx eax, byte [rbx + from]; mov [rbx + to], al; mov [rbx + nz_src], ax
+static void emit_transfer(Emitter *e, size_t from, size_t to)
+{
+	emit_rbx_mem(e, (const uint8_t[]){ 0x0F, 0xB6 }, 2, 0, from);
+	if (to != from)
+		emit_rbx_mem(e, (const uint8_t[]){ 0x88 }, 1, 0, to);
+	emit_rbx_mem(e, (const uint8_t[]){ 0x66, 0x89 }, 2, 0, offsetof(CPU, nz_src));
+}
+
+// Emits the few instructions simple enough to not need their handler.
+// Returns 0 if the instruction has to go through the handler instead
+static int emit_inline(Emitter *e, const DecodedOp *op)
+{
+	void (*operation)(CPU *) = instruction_table[op->opcode].operation;
+	void (*mode)(CPU *) = instruction_table[op->opcode].addr_mode;
+	size_t reg;
+
+#ifdef NES_TRACE
+	// inline code would bypass the tracer in the handlers
+	return 0;
+#endif
+
+	if (operation == CLC || operation == SEC)
+		emit_store_imm8(e, offsetof(CPU, C), operation == SEC);
+	else if (operation == CLD || operation == SED)
+		emit_store_imm8(e, offsetof(CPU, D), operation == SED);
+	else if (operation == CLI || operation == SEI)
+		emit_store_imm8(e, offsetof(CPU, I), operation == SEI);
+	else if (operation == CLV)
+		emit_store_imm8(e, offsetof(CPU, v_src), 0);
+	else if (operation == NOP)
+		;
+	else if ((operation == LDA || operation == LDX || operation == LDY) && mode == immediate) {
+		reg = operation == LDA ? offsetof(CPU, A) : operation == LDX ? offsetof(CPU, X) : offsetof(CPU, Y);
+		emit_store_imm8(e, reg, (uint8_t)op->operand);
+		// mov word [rbx + nz_src], imm16
+		emit_rbx_mem(e, (const uint8_t[]){ 0x66, 0xC7 }, 2, 0, offsetof(CPU, nz_src));
+		emit16(e, op->operand & 0xFF);
+	}
+	else if (operation == INX || operation == INY || operation == DEX || operation == DEY) {
+		reg = operation == INX || operation == DEX ? offsetof(CPU, X) : offsetof(CPU, Y);
+		// inc/dec byte [rbx + reg]
+		emit_rbx_mem(e, (const uint8_t[]){ 0xFE }, 1, operation == INX || operation == INY ? 0 : 1, reg);
+		emit_transfer(e, reg, reg);
+	}
+	else if (operation == TAX)
+		emit_transfer(e, offsetof(CPU, A), offsetof(CPU, X));
+	else if (operation == TXA)
+		emit_transfer(e, offsetof(CPU, X), offsetof(CPU, A));
+	else if (operation == TAY)
+		emit_transfer(e, offsetof(CPU, A), offsetof(CPU, Y));
+	else if (operation == TYA)
+		emit_transfer(e, offsetof(CPU, Y), offsetof(CPU, A));
+	else
+		return 0;
+
+	emit_advance_pc(e, op->length);
+	return 1;
+}
+
+static void emit_call_handler(Emitter *e, const DecodedOp *op)
+{
+	emit_bytes(e, (const uint8_t[]){ 0x48, 0x89, 0xDF }, 3);  // mov rdi, rbx
+	emit8(e, 0xBE);                                            // mov esi, operand
+	emit32(e, op->operand);
+	emit_bytes(e, (const uint8_t[]){ 0x48, 0xB8 }, 2);        // mov rax, handler
+	emit64(e, (uint64_t)(uintptr_t)fused_handlers[op->opcode]);
+	emit_bytes(e, (const uint8_t[]){ 0xFF, 0xD0 }, 2);        // call rax
+}
+
+// Absolute operands in $2000-$401F, see the top of the file
+static int touches_io(const DecodedOp *op)
+{
+	const Instruction *inst = &instruction_table[op->opcode];
+
+	if (inst->addr_mode != absolute && inst->addr_mode != abs_offset_x && inst->addr_mode != abs_offset_y)
+		return 0;
+	if (inst->operation == JMP || inst->operation == JSR)
+		return 0;
+	return op->operand >= 0x2000 && op->operand < 0x4020;
+}
+
+static int may_write(const DecodedOp *op)
+{
+	const Instruction *inst = &instruction_table[op->opcode];
+	void (*operation)(CPU *) = inst->operation;
+
+	if (operation == STA || operation == STX || operation == STY || operation == INC || operation == DEC)
+		return 1;
+	return (operation == ASL || operation == ROL || operation == LSR || operation == ROR) && inst->addr_mode != accumulator;
+}
+
+// Translates the leading ops of a block decoded from `page`, whose read_map
+// entry is `slot`. Returns NULL when there is nothing worth translating
+JitBlock jit_compile(struct JitCode *jit, const DecodedOp *ops, int count, uint8_t *const *slot, const uint8_t *page)
+{
+	uint8_t *exits[BLOCK_MAX_OPS * 3];
+	int n_exits = 0;
+	int n_ops = 0;
+
+	while (n_ops < count && !touches_io(&ops[n_ops]))
+		n_ops++;
+	if (n_ops == 0 || jit_full(jit))
+		return NULL;
+
+	uint8_t *start = jit->code + jit->used;
+	Emitter e = { start };
+
+	// push rbx; push r12; sub rsp, 8 (keeps the stack 16-byte aligned for calls)
+	emit_bytes(&e, (const uint8_t[]){ 0x53, 0x41, 0x54, 0x48, 0x83, 0xEC, 0x08 }, 7);
+	// mov rbx, rdi; mov r12, rsi
+	emit_bytes(&e, (const uint8_t[]){ 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4 }, 6);
+
+	for (int i = 0; i < n_ops; i++)
+	{
+		const DecodedOp *op = &ops[i];
+
+		if (!emit_inline(&e, op))
+			emit_call_handler(&e, op);
+
+		// add qword [rbx + total_cycles], cycles
+		emit_rbx_mem(&e, (const uint8_t[]){ 0x48, 0x83 }, 2, 0, offsetof(CPU, total_cycles));
+		emit8(&e, op->cycles);
+
+		if (i == n_ops - 1)
+			break;
+
+		// cmp [rbx + total_cycles], r12; jae exit
+		emit_rbx_mem(&e, (const uint8_t[]){ 0x4C, 0x39 }, 2, 4, offsetof(CPU, total_cycles));
+		exits[n_exits++] = emit_jcc(&e, JCC_AE);
+
+		if (may_write(op)) {
+			emit_bytes(&e, (const uint8_t[]){ 0x48, 0xB8 }, 2);  // mov rax, slot
+			emit64(&e, (uint64_t)(uintptr_t)slot);
+			emit_bytes(&e, (const uint8_t[]){ 0x48, 0x8B, 0x00 }, 3);  // mov rax, [rax]
+			emit_bytes(&e, (const uint8_t[]){ 0x48, 0xB9 }, 2);  // mov rcx, page
+			emit64(&e, (uint64_t)(uintptr_t)page);
+			emit_bytes(&e, (const uint8_t[]){ 0x48, 0x39, 0xC8 }, 3);  // cmp rax, rcx
+			exits[n_exits++] = emit_jcc(&e, JCC_NE);
+
+			// cmp byte [rbx + stop], 0; jne exit
+			emit_rbx_mem(&e, (const uint8_t[]){ 0x80 }, 1, 7, offsetof(CPU, stop));
+			emit8(&e, 0x00);
+			exits[n_exits++] = emit_jcc(&e, JCC_NE);
+		}
+	}
+
+	uint8_t *exit = e.p;
+	// add rsp, 8; pop r12; pop rbx; ret
+	emit_bytes(&e, (const uint8_t[]){ 0x48, 0x83, 0xC4, 0x08, 0x41, 0x5C, 0x5B, 0xC3 }, 8);
+
+	for (int i = 0; i < n_exits; i++)
+	{
+		int32_t rel = (int32_t)(exit - (exits[i] + 4));
+		for (int b = 0; b < 4; b++)
+			exits[i][b] = (uint8_t)((uint32_t)rel >> (8 * b));
+	}
+
+	jit->used += (size_t)(e.p - start);
+	return (JitBlock)(void *)start;
+}
+
+#else
+
+struct JitCode *jit_create() { return NULL; }
+void jit_delete(struct JitCode *jit) { (void)jit; }
+int jit_full(const struct JitCode *jit) { (void)jit; return 1; }
+void jit_reset(struct JitCode *jit) { (void)jit; }
+
+JitBlock jit_compile(struct JitCode *jit, const DecodedOp *ops, int count, uint8_t *const *slot, const uint8_t *page)
+{
+	(void)jit;
+	(void)ops;
+	(void)count;
+	(void)slot;
+	(void)page;
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#include <string.h>
+
+#include "crc32.h"
+
+#define CRC32_POLY 0xEDB88320  // reflected 0x04C11DB7
+
+/*
+Slice-by-8: crc_tables[k][b] is the CRC of byte b followed by k zero
+bytes, so eight input bytes are folded in with eight independent table
+lookups instead of eight dependent ones. Assumes a little-endian host.
+*/
+static uint32_t crc_tables[8][256];
+
+static void build_crc_tables(void)
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+		crc_tables[0][i] = crc;
+	}
+
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		for (int k = 1; k < 8; k++)
+			crc_tables[k][i] = (crc_tables[k - 1][i] >> 8) ^ crc_tables[0][crc_tables[k - 1][i] & 0xFF];
+	}
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	if (crc_tables[0][1] == 0)
+		build_crc_tables();
+
+	crc = ~crc;
+	for (; len >= 8; data += 8, len -= 8)
+	{
+		uint32_t lo, hi;
+		memcpy(&lo, data, 4);
+		memcpy(&hi, data + 4, 4);
+		lo ^= crc;
+		crc = crc_tables[7][lo & 0xFF] ^ crc_tables[6][(lo >> 8) & 0xFF] ^
+		      crc_tables[5][(lo >> 16) & 0xFF] ^ crc_tables[4][lo >> 24] ^
+		      crc_tables[3][hi & 0xFF] ^ crc_tables[2][(hi >> 8) & 0xFF] ^
+		      crc_tables[1][(hi >> 16) & 0xFF] ^ crc_tables[0][hi >> 24];
+	}
+	for (; len > 0; data++, len--)
+		crc = (crc >> 8) ^ crc_tables[0][(crc ^ *data) & 0xFF];
+
+	return ~crc;
+}
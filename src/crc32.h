@@ -0,0 +1,11 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32 (the zlib/PNG one) of `len` bytes, continuing from `crc`; start
+// with 0. Used to identify ROM images, see romdb.c
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "nes.h"
+#include "trace.h"
+
+#define DEFAULT_FRAMES 600
+#define DEFAULT_TRACE_LEN 65536
+
+/*
+Headless runner: drives the emulator core in a tight loop with no window,
+no vsync and no 60 Hz cap, so it can be used for throughput measurements
+and batch jobs.
+
+usage: nes-headless <rom> [-n frames] [--dump-frame out.ppm] [--dump-ram out.bin]
+                    [--trace out.bin] [--trace-len records] [--core table|fused|block|jit]
+                    [--no-idle-skip] [--palette colors.pal] [--frameskip N]
+
+--trace is only available in builds made with `make TRACE=1`; it keeps the
+last --trace-len instructions in a ring buffer and writes them as binary
+records at exit, which nes-tracedump turns back into text. Wait loop
+iterations skipped by the scheduler do not show up in traces; use
+--no-idle-skip to see every instruction.
+
+--frameskip N only draws every (N + 1)th frame; the emulation itself is
+unchanged. The last frame is always drawn so --dump-frame stays useful.
+*/
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s <rom> [-n frames] [--dump-frame out.ppm] [--dump-ram out.bin]\n"
+		            "       [--trace out.bin] [--trace-len records] [--core table|fused|block|jit]\n"
+		            "       [--no-idle-skip] [--palette colors.pal] [--frameskip N]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+static CpuCore parse_core(const char *name, const char *prog)
+{
+	if (!strcmp(name, "table"))
+		return CPU_CORE_TABLE;
+	if (!strcmp(name, "fused"))
+		return CPU_CORE_FUSED;
+	if (!strcmp(name, "block"))
+		return CPU_CORE_BLOCK;
+	if (!strcmp(name, "jit"))
+		return CPU_CORE_JIT;
+	usage(prog);
+	return CPU_CORE_TABLE;
+}
+
+// <time.h> is avoided on purpose since its clock() clashes with ours
+static double elapsed_seconds(const struct timeval *start, const struct timeval *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_usec - start->tv_usec) / 1e6;
+}
+
+// Writes the current frame as a binary PPM (alpha channel dropped)
+static void dump_frame(NES *nes, const char *fname)
+{
+	FILE *f = fopen(fname, "wb");
+	if (f == NULL) {
+		perror("Opening frame dump");
+		exit(EXIT_FAILURE);
+	}
+
+	static uint32_t rgba[NES_RES_WIDTH * NES_RES_HEIGHT];
+	ppu_frame_to_rgba(nes->ppu, rgba);
+
+	fprintf(f, "P6\n%d %d\n255\n", NES_RES_WIDTH, NES_RES_HEIGHT);
+	for (size_t i = 0; i < NES_RES_WIDTH * NES_RES_HEIGHT; i++)
+		fwrite(&rgba[i], 1, 3, f);
+	fclose(f);
+}
+
+// Writes the 2 KiB of internal CPU RAM as raw bytes
+static void dump_ram(NES *nes, const char *fname)
+{
+	FILE *f = fopen(fname, "wb");
+	if (f == NULL) {
+		perror("Opening RAM dump");
+		exit(EXIT_FAILURE);
+	}
+
+	fwrite(nes->cpu->ram, 1, RAM_BYTES, f);
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	char *rom_path = NULL;
+	char *frame_path = NULL;
+	char *ram_path = NULL;
+	char *trace_path = NULL;
+	long frames = DEFAULT_FRAMES;
+	long trace_len = DEFAULT_TRACE_LEN;
+	long frameskip = 0;
+	CpuCore core = CPU_CORE_FUSED;
+	bool idle_skip = true;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			frames = strtol(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "--dump-frame") && i + 1 < argc)
+			frame_path = argv[++i];
+		else if (!strcmp(argv[i], "--dump-ram") && i + 1 < argc)
+			ram_path = argv[++i];
+		else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+			trace_path = argv[++i];
+		else if (!strcmp(argv[i], "--trace-len") && i + 1 < argc)
+			trace_len = strtol(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "--core") && i + 1 < argc)
+			core = parse_core(argv[++i], argv[0]);
+		else if (!strcmp(argv[i], "--no-idle-skip"))
+			idle_skip = false;
+		else if (!strcmp(argv[i], "--frameskip") && i + 1 < argc)
+			frameskip = strtol(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "--palette") && i + 1 < argc)
+			ppu_load_palette(argv[++i]);
+		else if (argv[i][0] == '-' || rom_path != NULL)
+			usage(argv[0]);
+		else
+			rom_path = argv[i];
+	}
+
+	if (rom_path == NULL || frames <= 0 || trace_len <= 0 || frameskip < 0)
+		usage(argv[0]);
+
+#ifndef NES_TRACE
+	if (trace_path != NULL) {
+		fprintf(stderr, "Error: tracing requires a build made with `make TRACE=1`\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	NES *nes = init_nes();
+	nes->cpu->core = core;
+	nes->idle_skip = idle_skip;
+	nes->frameskip = (uint32_t)frameskip;
+	load_cartridge(nes, load_cart_from_file(rom_path));
+	reset(nes);
+
+	TraceRing *ring = NULL;
+	if (trace_path != NULL) {
+		ring = trace_ring_create((size_t)trace_len);
+		cpu_set_tracer(nes->cpu, trace_ring_hook, ring);
+	}
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	for (long frame = 0; frame < frames; frame++)
+	{
+		if (frame == frames - 1)
+			nes->frameskip = 0;
+		clock(nes);
+	}
+
+	gettimeofday(&end, NULL);
+
+	double seconds = elapsed_seconds(&start, &end);
+	fprintf(stderr, "Ran %ld frames (%llu CPU cycles) in %.3f s: %.1f frames/s\n",
+		    frames, (unsigned long long)nes->cpu->total_cycles, seconds, seconds > 0 ? frames / seconds : 0.0);
+
+	if (frame_path != NULL)
+		dump_frame(nes, frame_path);
+	if (ram_path != NULL)
+		dump_ram(nes, ram_path);
+
+	if (ring != NULL) {
+		FILE *f = fopen(trace_path, "wb");
+		if (f == NULL) {
+			perror("Opening trace file");
+			exit(EXIT_FAILURE);
+		}
+		trace_ring_write(ring, f);
+		fclose(f);
+		trace_ring_delete(ring);
+	}
+
+	delete_nes(nes);
+
+	return 0;
+}
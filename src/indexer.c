@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "cart.h"
+#include "crc32.h"
+#include "romdb.h"
+#include "romindex.h"
+
+#define DEFAULT_INDEX_NAME ".nes-index"
+#define MAX_THREADS 256
+
+/*
+ROM library indexer: walks a directory tree for .nes files, parses their
+headers and hashes their contents on a pool of threads, and writes a
+RomIndex (see romindex.h) that launchers and batch jobs can mmap instead
+of opening every file. Files whose size and mtime match the previous
+index are not read again, so rescanning an unchanged library only costs
+the directory walk and a stat per file.
+
+usage: nes-index <rom dir> [-o index] [-j threads]
+       nes-index --list <index> [--mapper N]
+
+The index defaults to <rom dir>/.nes-index.
+*/
+
+typedef struct ScanFile
+{
+	char *path;           // relative to the library root
+	RomIndexEntry entry;  // path and title are filled in when writing
+	bool missing;         // gone (or unreadable) by the time it was looked at
+	bool reused;          // unchanged since the previous index
+} ScanFile;
+
+typedef struct Scan
+{
+	const char *root;
+	const RomIndex *old;  // previous index, NULL on the first scan
+
+	ScanFile *files;
+	size_t count;
+	size_t capacity;
+
+	atomic_size_t next;   // next file for a worker to pick up
+} Scan;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s <rom dir> [-o index] [-j threads]\n"
+		            "       %s --list <index> [--mapper N]\n", prog, prog);
+	exit(EXIT_FAILURE);
+}
+
+// <time.h> is avoided on purpose since its clock() clashes with ours
+static double elapsed_seconds(const struct timeval *start, const struct timeval *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_usec - start->tv_usec) / 1e6;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir), name_len = strlen(name);
+	char *path = malloc(dir_len + name_len + 2);
+	memcpy(path, dir, dir_len);
+	path[dir_len] = '/';
+	memcpy(path + dir_len + 1, name, name_len + 1);
+	return path;
+}
+
+static bool is_rom_name(const char *name)
+{
+	size_t len = strlen(name);
+	return len > 4 && !strcasecmp(name + len - 4, ".nes");
+}
+
+static void add_file(Scan *scan, char *path)
+{
+	if (scan->count == scan->capacity) {
+		scan->capacity = scan->capacity ? scan->capacity * 2 : 1024;
+		scan->files = realloc(scan->files, scan->capacity * sizeof(ScanFile));
+	}
+	scan->files[scan->count++] = (ScanFile){ .path = path };
+}
+
+// Collects every .nes file under `rel` (relative to the root, "" for the
+// root itself). Hidden files and directories are skipped, which also
+// keeps the index out of its own listing
+static void walk(Scan *scan, const char *rel)
+{
+	char *dir_path = rel[0] ? join_path(scan->root, rel) : strdup(scan->root);
+	DIR *dir = opendir(dir_path);
+	if (dir == NULL) {
+		printf("[WARNING] Cannot open directory %s; skipping it\n", dir_path);
+		free(dir_path);
+		return;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (ent->d_name[0] == '.')
+			continue;
+
+		char *path = rel[0] ? join_path(rel, ent->d_name) : strdup(ent->d_name);
+		unsigned char type = ent->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			char *full = join_path(scan->root, path);
+			struct stat st;
+			type = stat(full, &st) == -1 ? DT_UNKNOWN : S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+			free(full);
+		}
+
+		// symlinked directories are not followed, they could loop
+		if (type == DT_DIR && ent->d_type != DT_LNK) {
+			walk(scan, path);
+			free(path);
+		} else if (type == DT_REG && is_rom_name(ent->d_name)) {
+			add_file(scan, path);
+		} else {
+			free(path);
+		}
+	}
+
+	closedir(dir);
+	free(dir_path);
+}
+
+static int compare_files(const void *a, const void *b)
+{
+	return strcmp(((const ScanFile *)a)->path, ((const ScanFile *)b)->path);
+}
+
+// Parses the header of the file mapped at `image` into `entry`
+static void describe_rom(RomIndexEntry *entry, uint8_t *image, size_t size)
+{
+	Cartridge cart = { .image = image, .image_size = size };
+	if (cart_parse_header(&cart) != NULL)
+		return;
+
+	entry->flags = ROMINDEX_VALID;
+	if (cart.nes2)
+		entry->flags |= ROMINDEX_NES2;
+	if (cart.contains_ram)
+		entry->flags |= ROMINDEX_BATTERY;
+	if (cart.chr_is_ram)
+		entry->flags |= ROMINDEX_CHR_RAM;
+	if (find_mapper(cart.mapper_id) != NULL)
+		entry->flags |= ROMINDEX_SUPPORTED;
+
+	entry->crc = cart.crc;
+	entry->prg_rom_size = (uint32_t)cart.prg_rom_size;
+	entry->chr_size = (uint32_t)cart.chr_rom_size;
+	entry->prg_ram_size = (uint32_t)cart.prg_ram_size;
+	entry->mapper_id = cart.mapper_id;
+	entry->submapper = cart.submapper;
+	entry->mirroring = cart.mirroring;
+	entry->timing = cart.timing;
+}
+
+static void index_file(Scan *scan, ScanFile *file)
+{
+	char *full = join_path(scan->root, file->path);
+	int fd = open(full, O_RDONLY);
+	free(full);
+
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1)
+			close(fd);
+		file->missing = true;
+		return;
+	}
+
+	RomIndexEntry *entry = &file->entry;
+	entry->mtime_sec = st.st_mtim.tv_sec;
+	entry->mtime_nsec = st.st_mtim.tv_nsec;
+	entry->file_size = (uint64_t)st.st_size;
+
+	const RomIndexEntry *old = scan->old != NULL ? romindex_find(scan->old, file->path) : NULL;
+	if (old != NULL && old->mtime_sec == entry->mtime_sec && old->mtime_nsec == entry->mtime_nsec
+	    && old->file_size == entry->file_size) {
+		*entry = *old;
+		file->reused = true;
+		close(fd);
+		return;
+	}
+
+	if (st.st_size > 0) {
+		uint8_t *image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image != MAP_FAILED) {
+			describe_rom(entry, image, (size_t)st.st_size);
+			munmap(image, (size_t)st.st_size);
+		}
+	}
+	close(fd);
+}
+
+static void *index_worker(void *arg)
+{
+	Scan *scan = arg;
+	for (;;)
+	{
+		size_t i = atomic_fetch_add_explicit(&scan->next, 1, memory_order_relaxed);
+		if (i >= scan->count)
+			return NULL;
+		index_file(scan, &scan->files[i]);
+	}
+}
+
+static uint32_t add_string(char **pool, uint32_t *size, uint32_t *capacity, const char *str, size_t len)
+{
+	while (*size + len + 1 > *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 65536;
+		*pool = realloc(*pool, *capacity);
+	}
+	uint32_t offset = *size;
+	memcpy(*pool + offset, str, len);
+	(*pool)[offset + len] = '\0';
+	*size += (uint32_t)len + 1;
+	return offset;
+}
+
+// Lays the scanned files out as index entries plus a string pool and
+// writes them. scan->files is sorted by path, as the index must be
+static void write_index(Scan *scan, const char *index_path)
+{
+	RomIndexEntry *entries = malloc((scan->count ? scan->count : 1) * sizeof(RomIndexEntry));
+	char *pool = NULL;
+	uint32_t pool_size = 0, pool_capacity = 0;
+	uint32_t count = 0;
+
+	for (size_t i = 0; i < scan->count; i++)
+	{
+		ScanFile *file = &scan->files[i];
+		if (file->missing)
+			continue;
+
+		const char *name = strrchr(file->path, '/');
+		name = name ? name + 1 : file->path;
+
+		RomIndexEntry *entry = &entries[count++];
+		*entry = file->entry;
+		entry->path = add_string(&pool, &pool_size, &pool_capacity, file->path, strlen(file->path));
+		entry->title = add_string(&pool, &pool_size, &pool_capacity, name, strlen(name) - 4);
+	}
+
+	romindex_write(index_path, entries, count, pool, pool_size);
+	free(entries);
+	free(pool);
+}
+
+static int scan_library(const char *root, const char *index_path, long threads)
+{
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	Scan scan = { .root = root };
+	RomIndex *old = romindex_open(index_path);
+	scan.old = old;
+
+	walk(&scan, "");
+	qsort(scan.files, scan.count, sizeof(ScanFile), compare_files);
+
+	// the CRC tables and the ROM database are built on first use; do that
+	// before there are several threads to race over them
+	crc32_update(0, NULL, 0);
+	romdb_find(0);
+
+	if ((size_t)threads > scan.count)
+		threads = scan.count ? (long)scan.count : 1;
+
+	pthread_t workers[MAX_THREADS];
+	for (long i = 0; i < threads; i++)
+	{
+		if (pthread_create(&workers[i], NULL, index_worker, &scan) != 0) {
+			perror("Starting index thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (long i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+
+	// the old entries are copied out, so the old index can go before the
+	// new one is renamed over it
+	romindex_close(old);
+	write_index(&scan, index_path);
+
+	size_t reused = 0, invalid = 0, missing = 0;
+	for (size_t i = 0; i < scan.count; i++)
+	{
+		reused += scan.files[i].reused;
+		missing += scan.files[i].missing;
+		invalid += !scan.files[i].missing && !(scan.files[i].entry.flags & ROMINDEX_VALID);
+		free(scan.files[i].path);
+	}
+	free(scan.files);
+
+	gettimeofday(&end, NULL);
+	fprintf(stderr, "Indexed %zu files (%zu read, %zu unchanged, %zu not valid ROMs, %zu unreadable) in %.3f s\n",
+		    scan.count - missing, scan.count - missing - reused, reused, invalid, missing, elapsed_seconds(&start, &end));
+	return 0;
+}
+
+static int list_index(const char *index_path, long mapper)
+{
+	RomIndex *index = romindex_open(index_path);
+	if (index == NULL) {
+		fprintf(stderr, "Error: cannot read ROM index %s\n", index_path);
+		return EXIT_FAILURE;
+	}
+
+	for (uint32_t i = 0; i < index->header->entry_count; i++)
+	{
+		const RomIndexEntry *entry = &index->entries[i];
+		if (mapper >= 0 && (!(entry->flags & ROMINDEX_VALID) || entry->mapper_id != mapper))
+			continue;
+
+		if (!(entry->flags & ROMINDEX_VALID)) {
+			printf("%-8s %-9s %s\n", "-", "invalid", romindex_string(index, entry->path));
+			continue;
+		}
+		printf("%08X %3u.%-2u %c %4u KiB PRG %4u KiB CHR %s %-5s %s%s\n",
+			   entry->crc, entry->mapper_id, entry->submapper,
+			   entry->flags & ROMINDEX_SUPPORTED ? ' ' : '!',
+			   entry->prg_rom_size / 1024, entry->chr_size / 1024,
+			   entry->flags & ROMINDEX_CHR_RAM ? "RAM" : "ROM",
+			   cart_timing_name(entry->timing),
+			   romindex_string(index, entry->title),
+			   entry->flags & ROMINDEX_BATTERY ? " [battery]" : "");
+	}
+
+	romindex_close(index);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *root = NULL;
+	char *index_path = NULL;
+	char *list_path = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	long mapper = -1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			index_path = argv[++i];
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			threads = strtol(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "--list") && i + 1 < argc)
+			list_path = argv[++i];
+		else if (!strcmp(argv[i], "--mapper") && i + 1 < argc)
+			mapper = strtol(argv[++i], NULL, 10);
+		else if (argv[i][0] == '-' || root != NULL)
+			usage(argv[0]);
+		else
+			root = argv[i];
+	}
+
+	if (list_path != NULL) {
+		if (root != NULL || index_path != NULL)
+			usage(argv[0]);
+		return list_index(list_path, mapper);
+	}
+
+	if (root == NULL || threads <= 0 || mapper >= 0)
+		usage(argv[0]);
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	struct stat st;
+	if (stat(root, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "Error: %s is not a directory\n", root);
+		return EXIT_FAILURE;
+	}
+
+	char *default_path = NULL;
+	if (index_path == NULL)
+		index_path = default_path = join_path(root, DEFAULT_INDEX_NAME);
+
+	int result = scan_library(root, index_path, threads);
+	free(default_path);
+	return result;
+}
@@ -14,13 +14,16 @@ int main(int argc, char **argv)
 	const char *button_names[] = { "Up", "Left", "Down", "Right",
 		                          "A", "B", "Select", "Start" };
 	bool keys_pressed[BUTTON_COUNT];
+	static uint32_t frame_rgba[NES_RES_WIDTH * NES_RES_HEIGHT];
 
 	NES *nes = init_nes();
-	if (argc == 2)
-		nes->cart = load_cart_from_file(argv[1]);
+	if (argc >= 2)
+		load_cartridge(nes, load_cart_from_file(argv[1]));
 	else
-		nes->cart = load_cart_from_file("resources/Donkey Kong (World) (Rev A).nes");
-	reset_cpu(nes->cpu);
+		load_cartridge(nes, load_cart_from_file("resources/Donkey Kong (World) (Rev A).nes"));
+	if (argc >= 3)
+		ppu_load_palette(argv[2]);
+	reset(nes);
 
 	InitWindow(width, height, "jNES Emulator");
 	DisableEventWaiting();
@@ -46,7 +49,8 @@ int main(int argc, char **argv)
 		// BeginTextureMode(target);
 		// EndTextureMode();
 
-		UpdateTexture(target.texture, nes->ppu->frame_pixels);
+		ppu_frame_to_rgba(nes->ppu, frame_rgba);
+		UpdateTexture(target.texture, frame_rgba);
 
 		BeginDrawing();
 		ClearBackground(BLACK);
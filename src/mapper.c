@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nes.h"
+#include "cart.h"
+#include "mapper.h"
+
+/*
+Mapper implementations. Each one keeps its registers in the cartridge's
+mapper_state and translates them into cart_map_prg/cart_map_chr calls.
+References are the nesdev wiki pages of the same name, e.g.
+https://www.nesdev.org/wiki/MMC1
+*/
+
+static void set_mirroring(Cartridge *cart, Mirroring mirroring)
+{
+	cart->mirroring = mirroring;
+	if (cart->nes != NULL)
+		ppu_set_mirroring(cart->nes->ppu, mirroring);
+}
+
+// The CPU's run was planned around when the IRQ would fire; make the
+// scheduler plan again after this write
+static void irq_changed(Cartridge *cart)
+{
+	if (cart->nes != NULL)
+		cart->nes->cpu->stop = true;
+}
+
+
+// NROM (0): 16 or 32 KiB of PRG and 8 KiB of CHR, nothing to switch
+
+static void nrom_reset(Cartridge *cart)
+{
+	cart_map_prg(cart, 0, 0x8000, 0);
+	cart_map_chr(cart, 0, 0x2000, 0);
+}
+
+
+/*
+MMC1 (1): registers are loaded one bit at a time over 5 writes. Bit 7
+set on any write resets the shift register and switches to PRG mode 3.
+The last write's address picks the register:
+
+$8000 control: mirroring (0, 1: one screen, 2: vertical 3: horizontal),
+      PRG mode (0, 1: 32 KiB at $8000, 2: first bank fixed at $8000,
+      3: last bank fixed at $C000) and CHR mode (0: 8 KiB, 1: two 4 KiB)
+$A000 CHR bank 0
+$C000 CHR bank 1
+$E000 PRG bank
+*/
+
+static void mmc1_update(Cartridge *cart)
+{
+	static const Mirroring mirroring[4] = { SINGLE_SCREEN_LOW, SINGLE_SCREEN_HIGH, VERTICAL, HORIZONTAL };
+	uint8_t control = cart->mapper_state.mmc1.control;
+	uint8_t prg = cart->mapper_state.mmc1.prg & 0x0F;
+
+	set_mirroring(cart, mirroring[control & 0x03]);
+
+	switch ((control >> 2) & 0x03)
+	{
+		case 0:
+		case 1:
+			cart_map_prg(cart, 0, 0x8000, prg >> 1);
+			break;
+		case 2:
+			cart_map_prg(cart, 0, 0x4000, 0);
+			cart_map_prg(cart, 1, 0x4000, prg);
+			break;
+		case 3:
+			cart_map_prg(cart, 0, 0x4000, prg);
+			cart_map_prg(cart, 1, 0x4000, -1);
+			break;
+	}
+	cart_update_map(cart);
+
+	if (control & 0x10) {
+		cart_map_chr(cart, 0, 0x1000, cart->mapper_state.mmc1.chr0);
+		cart_map_chr(cart, 1, 0x1000, cart->mapper_state.mmc1.chr1);
+	} else {
+		cart_map_chr(cart, 0, 0x2000, cart->mapper_state.mmc1.chr0 >> 1);
+	}
+}
+
+static void mmc1_reset(Cartridge *cart)
+{
+	cart->mapper_state.mmc1.shift = 0x10;
+	cart->mapper_state.mmc1.control = 0x0C;
+
+	// keep the mirroring from the header until the game sets its own
+	cart_map_prg(cart, 0, 0x4000, 0);
+	cart_map_prg(cart, 1, 0x4000, -1);
+	cart_map_chr(cart, 0, 0x2000, 0);
+}
+
+static void mmc1_write(Cartridge *cart, uint16_t addr, uint8_t value)
+{
+	if (value & 0x80) {
+		cart->mapper_state.mmc1.shift = 0x10;
+		cart->mapper_state.mmc1.control |= 0x0C;
+		mmc1_update(cart);
+		return;
+	}
+
+	bool done = cart->mapper_state.mmc1.shift & 0x01;
+	uint8_t data = (cart->mapper_state.mmc1.shift >> 1) | (value & 0x01) << 4;
+	if (!done) {
+		cart->mapper_state.mmc1.shift = data;
+		return;
+	}
+	cart->mapper_state.mmc1.shift = 0x10;
+
+	switch ((addr >> 13) & 0x03)
+	{
+		case 0: cart->mapper_state.mmc1.control = data; break;
+		case 1: cart->mapper_state.mmc1.chr0 = data;    break;
+		case 2: cart->mapper_state.mmc1.chr1 = data;    break;
+		case 3: cart->mapper_state.mmc1.prg = data;     break;
+	}
+	mmc1_update(cart);
+}
+
+
+// UxROM (2): 16 KiB PRG bank at $8000, the last bank fixed at $C000
+
+static void uxrom_reset(Cartridge *cart)
+{
+	cart_map_prg(cart, 0, 0x4000, 0);
+	cart_map_prg(cart, 1, 0x4000, -1);
+	cart_map_chr(cart, 0, 0x2000, 0);
+}
+
+static void uxrom_write(Cartridge *cart, uint16_t addr, uint8_t value)
+{
+	(void)addr;
+	cart->mapper_state.bank = value;
+	cart_map_prg(cart, 0, 0x4000, value);
+	cart_update_map(cart);
+}
+
+
+// CNROM (3): fixed PRG, 8 KiB CHR bank
+
+static void cnrom_write(Cartridge *cart, uint16_t addr, uint8_t value)
+{
+	(void)addr;
+	cart->mapper_state.bank = value;
+	cart_map_chr(cart, 0, 0x2000, value);
+}
+
+
+/*
+MMC3 (4): even/odd addresses in each 8 KiB range are different registers.
+
+$8000 bank select: R0-R7 for the next $8001 write, bit 6 swaps the
+      $8000 and $C000 PRG banks, bit 7 swaps the CHR halves
+$8001 bank data: R0, R1 2 KiB CHR, R2-R5 1 KiB CHR, R6, R7 8 KiB PRG
+$A000 mirroring, $A001 PRG RAM protect (ignored)
+$C000 IRQ latch, $C001 reload the counter on the next scanline
+$E000 disable and acknowledge the IRQ, $E001 enable it
+
+The IRQ counter is clocked once per rendered line. It is reloaded from
+the latch when it is 0 (or a reload was asked for), decremented otherwise,
+and fires the IRQ when it ends up 0 with the IRQ enabled.
+*/
+
+static void mmc3_update(Cartridge *cart)
+{
+	uint8_t select = cart->mapper_state.mmc3.select;
+	const uint8_t *r = cart->mapper_state.mmc3.regs;
+
+	// PRG: R6 and the second to last bank trade places
+	cart_map_prg(cart, select & 0x40 ? 2 : 0, 0x2000, r[6]);
+	cart_map_prg(cart, 1, 0x2000, r[7]);
+	cart_map_prg(cart, select & 0x40 ? 0 : 2, 0x2000, -2);
+	cart_map_prg(cart, 3, 0x2000, -1);
+	cart_update_map(cart);
+
+	// CHR: the 2 KiB banks are at $0000 normally and at $1000 inverted
+	int flip = select & 0x80 ? 4 : 0;
+	cart_map_chr(cart, (0 ^ flip) / 2, 0x0800, r[0] >> 1);
+	cart_map_chr(cart, (2 ^ flip) / 2, 0x0800, r[1] >> 1);
+	for (int i = 0; i < 4; i++)
+		cart_map_chr(cart, (4 + i) ^ flip, 0x0400, r[2 + i]);
+}
+
+static void mmc3_reset(Cartridge *cart)
+{
+	static const uint8_t regs[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+
+	for (int i = 0; i < 8; i++)
+		cart->mapper_state.mmc3.regs[i] = regs[i];
+	mmc3_update(cart);
+}
+
+static void mmc3_write(Cartridge *cart, uint16_t addr, uint8_t value)
+{
+	switch (addr & 0xE001)
+	{
+		case 0x8000:
+			cart->mapper_state.mmc3.select = value;
+			mmc3_update(cart);
+			break;
+		case 0x8001:
+			cart->mapper_state.mmc3.regs[cart->mapper_state.mmc3.select & 0x07] = value;
+			mmc3_update(cart);
+			break;
+		case 0xA000:
+			if (cart->mirroring != FOUR_SCREEN)
+				set_mirroring(cart, value & 0x01 ? HORIZONTAL : VERTICAL);
+			break;
+		case 0xA001:
+			break;
+		case 0xC000:
+			cart->mapper_state.mmc3.irq_latch = value;
+			irq_changed(cart);
+			break;
+		case 0xC001:
+			cart->mapper_state.mmc3.irq_counter = 0;
+			cart->mapper_state.mmc3.irq_reload = true;
+			irq_changed(cart);
+			break;
+		case 0xE000:
+			cart->mapper_state.mmc3.irq_enabled = false;
+			cart->irq = false;
+			break;
+		case 0xE001:
+			cart->mapper_state.mmc3.irq_enabled = true;
+			irq_changed(cart);
+			break;
+	}
+}
+
+static void mmc3_scanline(Cartridge *cart)
+{
+	if (cart->mapper_state.mmc3.irq_counter == 0 || cart->mapper_state.mmc3.irq_reload) {
+		cart->mapper_state.mmc3.irq_counter = cart->mapper_state.mmc3.irq_latch;
+		cart->mapper_state.mmc3.irq_reload = false;
+	} else {
+		cart->mapper_state.mmc3.irq_counter--;
+	}
+
+	if (cart->mapper_state.mmc3.irq_counter == 0 && cart->mapper_state.mmc3.irq_enabled)
+		cart->irq = true;
+}
+
+static uint32_t mmc3_scanlines_to_irq(const Cartridge *cart)
+{
+	if (!cart->mapper_state.mmc3.irq_enabled)
+		return 0;
+	if (cart->mapper_state.mmc3.irq_counter == 0 || cart->mapper_state.mmc3.irq_reload)
+		return cart->mapper_state.mmc3.irq_latch + 1;
+	return cart->mapper_state.mmc3.irq_counter;
+}
+
+
+static const Mapper mappers[] = {
+	{ 0, "NROM",  nrom_reset,  NULL,        NULL,          NULL },
+	{ 1, "MMC1",  mmc1_reset,  mmc1_write,  NULL,          NULL },
+	{ 2, "UxROM", uxrom_reset, uxrom_write, NULL,          NULL },
+	{ 3, "CNROM", nrom_reset,  cnrom_write, NULL,          NULL },
+	{ 4, "MMC3",  mmc3_reset,  mmc3_write,  mmc3_scanline, mmc3_scanlines_to_irq },
+};
+
+// NULL for mappers we don't have
+const Mapper *find_mapper(uint16_t id)
+{
+	for (size_t i = 0; i < sizeof(mappers) / sizeof(mappers[0]); i++)
+	{
+		if (mappers[i].id == id)
+			return &mappers[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,55 @@
+#ifndef _MAPPER_H
+#define _MAPPER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct Cartridge;
+
+/*
+A mapper only reacts to events: CPU writes to $8000-$FFFF, and the PPU
+fetching a new scanline (on the real board, address line A12 rising as
+the PPU moves from background to sprite patterns around dot 260). It
+answers by pointing the cartridge's prg_map/chr_map at other banks, so
+reads never go through the mapper and a bank switch costs the same no
+matter how often the banks are read afterwards.
+*/
+typedef struct Mapper
+{
+	uint16_t id;
+	const char *name;
+	void (*reset)(struct Cartridge *);                      // power-on banks
+	void (*write)(struct Cartridge *, uint16_t, uint8_t);   // CPU write to $8000-$FFFF, NULL if ignored
+	void (*scanline)(struct Cartridge *);                   // once per rendered line, NULL if not needed
+	uint32_t (*scanlines_to_irq)(const struct Cartridge *); // scanline calls until the IRQ fires, 0 for never
+} Mapper;
+
+// Registers of the mapper in use
+typedef union MapperState
+{
+	// UxROM, CNROM: a single bank register
+	uint8_t bank;
+
+	struct
+	{
+		uint8_t shift;    // serial port; the 1 shifted in on reset marks the 5th write
+		uint8_t control;  // mirroring, PRG and CHR bank modes
+		uint8_t chr0;
+		uint8_t chr1;
+		uint8_t prg;
+	} mmc1;
+
+	struct
+	{
+		uint8_t select;   // $8000: register R0-R7 the next $8001 write goes to, bank modes
+		uint8_t regs[8];
+		uint8_t irq_latch;
+		uint8_t irq_counter;
+		bool    irq_reload;
+		bool    irq_enabled;
+	} mmc3;
+} MapperState;
+
+const Mapper *find_mapper(uint16_t);
+
+#endif
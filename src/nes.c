@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "nes.h"
 #include "cpu.h"
@@ -7,15 +8,29 @@
 #define VRAM_MAX_ADDR    0x2000
 #define PPU_REG_MAX_ADDR 0x4000
 
+#define IDLE_LOOP_INSTS     16    // longest wait loop looked for
+#define IDLE_PROBE_INTERVAL 1024  // CPU cycles run between looks
+
+#define SAVE_FLUSH_FRAMES   60    // battery RAM is pushed to disk about once a second
+
 
 NES *init_nes()
 {
-	NES *nes = malloc(sizeof(NES));
+	NES *nes = calloc(1, sizeof(NES));
 	nes->cpu = init_cpu();
 	nes->ppu = init_ppu();
 	nes->cart = NULL;
+	nes->idle_skip = true;
 	nes->cpu->nes = nes;
 	nes->ppu->nes = nes;
+
+	// CPU RAM is mirrored 4 ways across $0000-$1FFF
+	for (size_t page = 0; page < VRAM_MAX_ADDR >> 8; page++)
+	{
+		uint8_t *ram_page = &nes->cpu->ram[(page & 0x07) << 8];
+		nes->read_map[page] = ram_page;
+		nes->write_map[page] = ram_page;
+	}
 	return nes;
 }
 
@@ -24,7 +39,7 @@ void delete_nes(NES *nes)
 	if (nes->cart != NULL)
 		delete_cart(nes->cart);
 	free(nes->ppu);
-	free(nes->cpu);
+	delete_cpu(nes->cpu);
 	free(nes);
 }
 
@@ -36,40 +51,63 @@ void dump_nes_info(NES *nes, char *buffer)
 	{
 		if (i % 8 == 0)
 			pos += sprintf(pos, "\n");
-		pos += sprintf(pos, "%02X ", cpu->memory[i]);
+		pos += sprintf(pos, "%02X ", cpu->ram[i]);
 
 	}
 
-	pos += sprintf(pos, "\n\nA:%02X X:%02X Y:%02X P:%02X\nSP:%02X PPU: %03u, %03u CYC:%u\n\n", cpu->A, cpu->X, cpu->Y, get_flags(cpu), cpu->SP, nes->ppu->scanline, nes->ppu->cycle, cpu->total_cycles);
-	pos += sprintf(pos, "Flags: NVUBDIZC\n       %d%d%d%d%d%d%d%d\n\n", cpu->N, cpu->V, cpu->U, cpu->B, cpu->D, cpu->I, cpu->Z, cpu->C);
+	pos += sprintf(pos, "\n\nA:%02X X:%02X Y:%02X P:%02X\nSP:%02X PPU: %03u, %03u CYC:%llu\n\n", cpu->A, cpu->X, cpu->Y, get_flags(cpu), cpu->SP, nes->ppu->scanline, nes->ppu->cycle, (unsigned long long)cpu->total_cycles);
+	pos += sprintf(pos, "Flags: NVUBDIZC\n       %d%d%d%d%d%d%d%d\n\n", cpu_flag_n(cpu), cpu_flag_v(cpu), cpu->U, cpu->B, cpu->D, cpu->I, cpu_flag_z(cpu), cpu->C);
+	pos += sprintf(pos, "PPUCTRL:%02X PPUMASK:%02X PPUSTATUS:%02X\nv:%04X t:%04X x:%d\n\n", nes->ppu->ctrl, nes->ppu->mask, nes->ppu->status, nes->ppu->vram_addr, nes->ppu->tram_addr, nes->ppu->fine_x);
 	*pos = '\0';
 
 }
 
 
 
-void cpu_write(NES *nes, uint16_t addr, uint8_t value)
+/*
+Scheduling: the CPU runs whole instructions and the PPU lags behind it.
+The PPU is only "caught up" to the CPU's current cycle when the CPU
+touches a PPU register or OAM DMA, writes to a mapper (bank and
+mirroring switches change what the PPU fetches), or when the next PPU
+event (vblank/NMI, end of frame, mapper IRQ) is due. An instruction's bus accesses happen before its cycles
+are added to total_cycles, so a catch-up on access brings the PPU to the
+dot (3 per CPU cycle) on which that instruction started.
+*/
+static void ppu_catch_up(NES *nes)
 {
+	ppu_run(nes->ppu, nes->cpu->total_cycles * 3);
+}
+
+// Slow path for pages without a direct mapping in write_map
+void cpu_write_io(NES *nes, uint16_t addr, uint8_t value)
+{
+	nes->io_accesses++;
+
 	if (addr < VRAM_MAX_ADDR)
 	{
 		// CPU VRAM is mirrored 4 ways so we strip
 		// off the 2 most significant bits
 		addr &= 0b0011111111111;
-		nes->cpu->memory[addr] = value;
+		nes->cpu->ram[addr] = value;
 	} 
 	else if (addr < PPU_REG_MAX_ADDR)
 	{
+		ppu_catch_up(nes);
+
 		// PPU registers are addr 0x2000 through 0x2007
 		// and they are mirrored up to 0x3FFF
 		addr &= 0b0010000000000111;
 		switch (addr) {
 			case 0x2000:
-				set_ppuctrl(nes->ppu, value);
-				nes->ppu->tram_addr.nametable_x = nes->ppu->ctrl.nametable_x;
-				nes->ppu->tram_addr.nametable_y = nes->ppu->ctrl.nametable_y;
+				nes->ppu->ctrl = value;
+				nes->ppu->tram_addr = (nes->ppu->tram_addr & ~(LOOPY_NAMETABLE_X | LOOPY_NAMETABLE_Y))
+				                    | (uint16_t)(value & (CTRL_NAMETABLE_X | CTRL_NAMETABLE_Y)) << 10;
 				break;
 			case 0x2001:
-				set_ppumask(nes->ppu, value);
+				nes->ppu->mask = value;
+				// scanline counters only count while rendering
+				if (nes->cart->mapper->scanline != NULL)
+					nes->cpu->stop = true;
 				break;
 			case 0x2002:
 				printf("[WARNING] Attemting to write to read-only register PPU\n");
@@ -78,40 +116,34 @@ void cpu_write(NES *nes, uint16_t addr, uint8_t value)
 				nes->ppu->oam_addr = value;
 				break;
 			case 0x2004:
-				nes->ppu->oam_data = value;
+				nes->ppu->oam_memory[nes->ppu->oam_addr++] = value;
 				break;
 			case 0x2005:
 				// PPU Scroll
 				if (!nes->ppu->address_latch) {
 					nes->ppu->fine_x = value & 0x07;
-					nes->ppu->tram_addr.coarse_x = value >> 3;
+					nes->ppu->tram_addr = (nes->ppu->tram_addr & ~LOOPY_COARSE_X) | value >> 3;
 					nes->ppu->address_latch = true;
 				} else {
-					nes->ppu->tram_addr.fine_y = value & 0x07;
-					nes->ppu->tram_addr.coarse_y = value >> 3;
+					nes->ppu->tram_addr = (nes->ppu->tram_addr & ~(LOOPY_FINE_Y | LOOPY_COARSE_Y))
+					                    | (uint16_t)(value & 0x07) << 12 | (uint16_t)(value >> 3) << 5;
 					nes->ppu->address_latch = false;
 				}
 				break;
 			case 0x2006:
 				// PPU addr
 				if (!nes->ppu->address_latch) {
-					uint16_t data = (uint16_t)((value & 0x3F) << 8);
-					data |= get_loopyregister(&nes->ppu->tram_addr) & 0x00FF;
-					set_loopyregister(&nes->ppu->tram_addr, data);
+					nes->ppu->tram_addr = (uint16_t)((value & 0x3F) << 8) | (nes->ppu->tram_addr & 0x00FF);
 					nes->ppu->address_latch = true;
 				} else {
-					uint16_t data = (get_loopyregister(&nes->ppu->tram_addr) & 0xFF00) | value;
-					set_loopyregister(&nes->ppu->vram_addr, data);
+					nes->ppu->vram_addr = (nes->ppu->tram_addr & 0xFF00) | value;
 					nes->ppu->address_latch = false;
 				}
 				break;
 			case 0x2007:
 				// PPU Data
-				ppu_write(nes, get_loopyregister(&nes->ppu->vram_addr), value);
-
-				uint16_t vram = get_loopyregister(&nes->ppu->vram_addr);
-				uint8_t inc = nes->ppu->ctrl.increment_mode? 32 : 1;
-				set_loopyregister(&nes->ppu->vram_addr, vram + inc);
+				ppu_write(nes, nes->ppu->vram_addr, value);
+				nes->ppu->vram_addr = (nes->ppu->vram_addr + (nes->ppu->ctrl & CTRL_INCREMENT ? 32 : 1)) & LOOPY_ADDR;
 				break;
 			default:
 				perror("Invalid PPU Addr");
@@ -119,6 +151,7 @@ void cpu_write(NES *nes, uint16_t addr, uint8_t value)
 		}
 	} else if (addr == 0x4014) {
 		// https://wiki.nesdev.com/w/index.php/PPU_programmer_reference#OAM_DMA_.28.244014.29_.3E_write
+		ppu_catch_up(nes);
 		oam_dma(nes, value);
 	} else if (addr < 0x4016) {
 		// TODO write to APU here
@@ -129,23 +162,34 @@ void cpu_write(NES *nes, uint16_t addr, uint8_t value)
 	} else if (addr < 0x6000) {
 		printf("[WARNING] Attemting to write to expansion ROM; ignoring\n");
 	} else if (addr < 0x8000) {
-		// SRAM
-		printf("[WARNING] Attemting to write to unimplemented SRAM; ignoring\n");
+		// PRG RAM is normally in write_map; this is a wait loop probe
+		// (see find_idle_loop) or a cart without any
+		cart_write_prg_ram(nes->cart, addr, value);
 	} else {
-		printf("[WARNING] Attemting to write to PRG ROM; ignoring\n");
+		// the PPU has to have drawn everything up to here with the old banks
+		if (nes->cart->mapper->write != NULL)
+			ppu_catch_up(nes);
+		cart_write_prg(nes->cart, addr, value);
 	}
 }
 
 
-uint8_t cpu_read(NES *nes, uint16_t addr) {
+// Slow path for pages without a direct mapping in read_map
+uint8_t cpu_read_io(NES *nes, uint16_t addr) {
 	uint8_t data = 0x00;
 
+	// polling PPUSTATUS is what wait loops do, everything else counts
+	if (addr < VRAM_MAX_ADDR || addr >= PPU_REG_MAX_ADDR || (addr & 0x0007) != 0x0002)
+		nes->io_accesses++;
+
 	if (addr < VRAM_MAX_ADDR) {
 		// CPU VRAM is mirrored 4 ways so we strip
 		// off the 2 most significant bits
 		addr &= 0b0011111111111;
-		data = nes->cpu->memory[addr];
+		data = nes->cpu->ram[addr];
 	} else if (addr < PPU_REG_MAX_ADDR) {
+		ppu_catch_up(nes);
+
 		// PPU registers are addr 0x2000 through 0x2007
 		// and they are mirrored up to 0x3FFF
 		addr &= 0b0010000000000111;
@@ -157,20 +201,18 @@ uint8_t cpu_read(NES *nes, uint16_t addr) {
 				printf("[WARNING] Attemting to read write-only register PPUMASK\n");
 				break;			
 			case 0x2002:
-				data = get_ppustatus(nes->ppu);
-
 				// Possibly pick up noise from 5 small bits
 				// left over from last PPU bus transaction
-				data |= nes->ppu->data_buffer & 0x1F;
+				data = nes->ppu->status | (nes->ppu->data_buffer & 0x1F);
 
-				nes->ppu->status.vertical_blank = 0;
+				nes->ppu->status &= ~STATUS_VBLANK;
 				nes->ppu->address_latch = false;
 				break;
 			case 0x2003:
 				printf("[WARNING] Attemting to read write-only register OAMADDR\n");
 				break;
 			case 0x2004:
-				data = nes->ppu->oam_data;
+				data = nes->ppu->oam_memory[nes->ppu->oam_addr];
 				break;
 			case 0x2005:
 				printf("[WARNING] Attemting to read write-only register PPUSCROLL\n");
@@ -180,15 +222,13 @@ uint8_t cpu_read(NES *nes, uint16_t addr) {
 				break;
 			case 0x2007:
 				data = nes->ppu->data_buffer;
-				uint16_t vram_addr = get_loopyregister(&nes->ppu->vram_addr);
+				uint16_t vram_addr = nes->ppu->vram_addr;
 				nes->ppu->data_buffer = ppu_read(nes, vram_addr);
 				
 				if (vram_addr >= 0x3F00)
 					data = nes->ppu->data_buffer;
 
-				uint16_t vram = get_loopyregister(&nes->ppu->vram_addr);
-				uint8_t inc = nes->ppu->ctrl.increment_mode? 32 : 1;
-				set_loopyregister(&nes->ppu->vram_addr, vram + inc);
+				nes->ppu->vram_addr = (vram_addr + (nes->ppu->ctrl & CTRL_INCREMENT ? 32 : 1)) & LOOPY_ADDR;
 
 				break;
 			default:
@@ -206,7 +246,7 @@ uint8_t cpu_read(NES *nes, uint16_t addr) {
 	} else if (addr < 0x6000) {
 		printf("[WARNING] Attempting to read from unimplemented expansion ROM address %04X; returning 0\n", addr);
 	} else if (addr < 0x8000) {
-		printf("[WARNING] Attempting to read from unimplemented SRAM address %04X; returning 0\n", addr);
+		// no PRG RAM on this cart, nothing drives the bus
 	} else {
 		addr -= 0x8000;
 		data = cart_read_prg(nes->cart, addr);
@@ -236,44 +276,36 @@ uint8_t ppu_read(NES *nes, uint16_t addr) {
 
 	} else if (addr < 0x3F00) {
 
-		addr &= 0x0FFF;
-		switch (nes->cart->mirroring) {
-			// credit to javidx9 (OneLoneCoder) for working this out
-			case VERTICAL:
-				if (addr < 0x0400)
-					data = nes->ppu->nametable[0][addr & 0x03FF];
-				else if (addr < 0x0800)
-					data = nes->ppu->nametable[1][addr & 0x03FF];
-				else if (addr < 0x0C00)
-					data = nes->ppu->nametable[0][addr & 0x03FF];
-				else
-					data = nes->ppu->nametable[1][addr & 0x03FF];
-				break;
-			case HORIZONTAL:
-				if (addr < 0x0400)
-					data = nes->ppu->nametable[0][addr & 0x03FF];
-				else if (addr < 0x0800)
-					data = nes->ppu->nametable[0][addr & 0x03FF];
-				else if (addr < 0x0C00)
-					data = nes->ppu->nametable[1][addr & 0x03FF];
-				else
-					data = nes->ppu->nametable[1][addr & 0x03FF];
-				break;
-			default:
-				fprintf(stderr, "[WARNING] Unsupported mirroring type in PPU READ function\n");
-		}
+		data = *ppu_nametable(nes->ppu, addr);
+
 	} else if (addr >= 0x3F00 && addr <= 0x3FFF) {
 		addr &= 0x001F;
 		if (addr == 0x0010) addr = 0x0000;
 		if (addr == 0x0014) addr = 0x0004;
 		if (addr == 0x0018) addr = 0x0008;
 		if (addr == 0x001C) addr = 0x000C;
-		data = nes->ppu->palette_table[addr] & (nes->ppu->mask.greyscale ? 0x30 : 0x3F);
+		data = nes->ppu->palette_table[addr] & (nes->ppu->mask & MASK_GREYSCALE ? 0x30 : 0x3F);
 	}
 	return data;
 }
 
 
+// Pattern table row at `addr` with both bit planes, 2 bits per pixel,
+// straight from the cartridge's pre-expanded CHR
+uint16_t ppu_read_row(NES *nes, uint16_t addr)
+{
+	return cart_chr_row(nes->cart, addr & 0x1FFF);
+}
+
+// Called by the PPU on dot 260 of every rendered line, for mappers that
+// count scanlines
+void ppu_scanline(NES *nes)
+{
+	Cartridge *cart = nes->cart;
+	if (cart->mapper->scanline != NULL)
+		cart->mapper->scanline(cart);
+}
+
 void ppu_write(NES *nes, uint16_t addr, uint8_t value) {
 	addr &= 0x3FFF;
 
@@ -283,32 +315,8 @@ void ppu_write(NES *nes, uint16_t addr, uint8_t value) {
 
 	} else if (addr < 0x3F00) {
 
-		addr &= 0x0FFF;
-		switch (nes->cart->mirroring) {
-			// credit to javidx9 (OneLoneCoder) for working this out
-			case VERTICAL:
-				if (addr < 0x0400)
-					nes->ppu->nametable[0][addr & 0x03FF] = value;
-				else if (addr < 0x0800)
-					nes->ppu->nametable[1][addr & 0x03FF] = value;
-				else if (addr < 0x0C00)
-					nes->ppu->nametable[0][addr & 0x03FF] = value;
-				else
-					nes->ppu->nametable[1][addr & 0x03FF] = value;
-				break;
-			case HORIZONTAL:
-				if (addr < 0x0400)
-					nes->ppu->nametable[0][addr & 0x03FF] = value;
-				else if (addr < 0x0800)
-					nes->ppu->nametable[0][addr & 0x03FF] = value;
-				else if (addr < 0x0C00)
-					nes->ppu->nametable[1][addr & 0x03FF] = value;
-				else
-					nes->ppu->nametable[1][addr & 0x03FF] = value;
-				break;
-			default:
-				fprintf(stderr, "[WARNING] Unsupported mirroring type in PPU READ function\n");
-		}
+		*ppu_nametable(nes->ppu, addr) = value;
+
 	} else if (addr >= 0x3F00 && addr <= 0x3FFF) {
 		addr &= 0x001F;
 		if (addr == 0x0010) addr = 0x0000;
@@ -321,26 +329,188 @@ void ppu_write(NES *nes, uint16_t addr, uint8_t value) {
 
 void load_cartridge(NES *nes, Cartridge *cart) {
 	nes->cart = cart;
+	cart->nes = nes;
+	cart->cpu_read_map = nes->read_map;
+	cart->cpu_write_map = nes->write_map;
+	cart_update_map(cart);
+	ppu_set_mirroring(nes->ppu, cart->mirroring);
 }
 
 void reset(NES *nes) {
 	reset_cpu(nes->cpu);
 	reset_ppu(nes->ppu);
+
+	// line the PPU timeline up with the CPU's cycle counter
+	nes->ppu->dots = nes->cpu->total_cycles * 3;
+}
+
+// Runs the system until the PPU has finished a frame
+typedef struct IdleSnapshot
+{
+	uint16_t PC;
+	uint8_t  A, X, Y, SP, P;
+	uint32_t io_accesses;
+	uint8_t  ram[RAM_BYTES];
+} IdleSnapshot;
+
+static void take_snapshot(NES *nes, IdleSnapshot *snap)
+{
+	CPU *cpu = nes->cpu;
+
+	snap->PC = cpu->PC;
+	snap->A = cpu->A;
+	snap->X = cpu->X;
+	snap->Y = cpu->Y;
+	snap->SP = cpu->SP;
+	snap->P = get_flags(cpu);
+	snap->io_accesses = nes->io_accesses;
+	memcpy(snap->ram, cpu->ram, RAM_BYTES);
+}
+
+static bool same_state(NES *nes, const IdleSnapshot *snap)
+{
+	CPU *cpu = nes->cpu;
+
+	return cpu->PC == snap->PC && cpu->A == snap->A && cpu->X == snap->X && cpu->Y == snap->Y
+		&& cpu->SP == snap->SP && get_flags(cpu) == snap->P && nes->io_accesses == snap->io_accesses
+		&& !memcmp(cpu->ram, snap->ram, RAM_BYTES);
+}
+
+/*
+Steps the CPU through at most IDLE_LOOP_INSTS instructions looking for a
+wait loop at the current PC (`JMP *`, `LDA $2002 / BPL`, polling a RAM
+flag set by the NMI handler...). If PC comes back with the registers,
+flags and RAM exactly as they were, and nothing but PPUSTATUS was read
+over I/O (PRG RAM writes included), returns the length of one iteration in cycles, 0 otherwise.
+*/
+static uint64_t find_idle_loop(NES *nes, uint64_t until)
+{
+	IdleSnapshot snap;
+	CPU *cpu = nes->cpu;
+	uint64_t start = cpu->total_cycles;
+
+	uint64_t period = 0;
+
+	// PRG RAM is too big to snapshot every time; send its writes through
+	// cpu_write_io instead, which counts them as I/O
+	cart_trap_prg_ram_writes(nes->cart, true);
+
+	take_snapshot(nes, &snap);
+	for (int i = 0; i < IDLE_LOOP_INSTS && cpu->total_cycles < until && !cpu->stop; i++)
+	{
+		cpu_step(cpu);
+		if (cpu->PC == snap.PC) {
+			period = same_state(nes, &snap) ? cpu->total_cycles - start : 0;
+			break;
+		}
+	}
+
+	cart_trap_prg_ram_writes(nes->cart, false);
+	return period;
+}
+
+/*
+PPU dot the CPU has to be stopped at next: the next PPU event, or the
+scanline on which the mapper raises its IRQ. While the IRQ is pending
+but masked the CPU goes an instruction at a time, so it is taken right
+after the CLI (or RTI) that unmasks it.
+*/
+static uint64_t next_event(NES *nes)
+{
+	PPU *ppu = nes->ppu;
+	Cartridge *cart = nes->cart;
+
+	if (cart->irq)
+		return nes->cpu->total_cycles * 3 + 1;
+
+	uint64_t event = ppu->dots + ppu_dots_to_event(ppu);
+	uint32_t lines = cart->mapper->scanlines_to_irq != NULL ? cart->mapper->scanlines_to_irq(cart) : 0;
+	if (lines != 0) {
+		uint32_t dots = ppu_dots_to_scanline(ppu, lines);
+		if (dots != UINT32_MAX && ppu->dots + dots < event)
+			event = ppu->dots + dots;
+	}
+	return event;
+}
+
+// CPU cycle wait loop iterations may be skipped up to: `until`, or the
+// next event if a register write has brought that forward
+static uint64_t skip_limit(NES *nes, uint64_t until)
+{
+	uint64_t event = (next_event(nes) + 2) / 3;
+
+	// the PPU lags behind the CPU; if the CPU is already past the event
+	// the PPU has to catch up before the next one can be found
+	if (event <= nes->cpu->total_cycles) {
+		ppu_catch_up(nes);
+		event = (next_event(nes) + 2) / 3;
+	}
+	return event < until ? event : until;
+}
+
+/*
+Runs the CPU up to `until`, skipping whole iterations of wait loops.
+
+Nothing a wait loop can see changes before the next scheduler event:
+RAM and registers only change through the CPU itself, and PPUSTATUS only
+on the dots ppu_dots_to_event reports. So every iteration up to the
+deadline would leave the machine in the same state, and only the clock
+needs to move. Iterations are skipped whole so the loop stays in phase,
+and the last partial one runs normally to read PPUSTATUS at the right dot.
+
+Where sprite 0 and the overflow flag may change depends on OAM and
+PPUMASK, which the CPU can write after `until` was worked out, so the
+limit is checked again before every skip.
+*/
+static void run_cpu(NES *nes, uint64_t until)
+{
+	CPU *cpu = nes->cpu;
+
+	if (!nes->idle_skip) {
+		cpu_run(cpu, until);
+		return;
+	}
+
+	while (cpu->total_cycles < until && !cpu->stop)
+	{
+		uint64_t period = find_idle_loop(nes, until);
+		uint64_t limit = period != 0 ? skip_limit(nes, until) : 0;
+		if (period != 0 && cpu->total_cycles < limit)
+			cpu->total_cycles += (limit - cpu->total_cycles) / period * period;
+
+		uint64_t chunk = cpu->total_cycles + IDLE_PROBE_INTERVAL;
+		cpu_run(cpu, chunk < until ? chunk : until);
+	}
 }
 
 void clock(NES *nes) {
+	CPU *cpu = nes->cpu;
+	PPU *ppu = nes->ppu;
 
-	nes->ppu->frame_ready = false;
+	ppu->frame_ready = false;
+	ppu->suppress_output = nes->frameskip != 0 && nes->frame_count % (nes->frameskip + 1) != 0;
+	nes->frame_count++;
 
-	for (size_t i = 0; !nes->ppu->frame_ready; ++i)
+	while (!ppu->frame_ready)
 	{
-		if (i % 3 == 0) 
-		{
+		uint64_t deadline = next_event(nes);
 
-			// printf("CPU Clock\n");
-			clock_cpu(nes->cpu);
+		// run the CPU until its clock, in dots, reaches the deadline, or
+		// a write moves the deadline
+		cpu->stop = false;
+		run_cpu(nes, (deadline + 2) / 3);
+
+		ppu_catch_up(nes);
+
+		if (ppu->nmi)
+		{
+			ppu->nmi = false;
+			NMI(cpu);
+		} else if (nes->cart->irq && !cpu->I) {
+			IRQ(cpu);
 		}
-		// printf("PPU Clock\n");
-		ppu_clock(nes->ppu);
 	}
+
+	if (nes->frame_count % SAVE_FLUSH_FRAMES == 0)
+		cart_flush_save(nes->cart);
 }
@@ -5,6 +5,8 @@
 #include "cpu.h"
 #include "cart.h"
 
+#define CPU_PAGES 256
+
 typedef struct NES
 {
 	PPU       *ppu;
@@ -14,16 +16,32 @@ typedef struct NES
 	uint8_t    controller2_state;
 
 	size_t total_clocks;
+
+	// frameskip: only every (frameskip + 1)th frame is drawn, the others
+	// run with the PPU's pixel output suppressed
+	uint32_t frameskip;
+	uint64_t frame_count;
+
+	// wait loop skipping in the scheduler, see run_cpu() in nes.c
+	bool     idle_skip;
+	uint32_t io_accesses;  // CPU I/O accesses other than $2002 reads
+
+	// CPU memory map, one entry per 256 byte page. Pages backed by plain
+	// memory point straight at it; NULL pages go through the I/O handlers
+	uint8_t *read_map[CPU_PAGES];
+	uint8_t *write_map[CPU_PAGES];
 } NES;
 
 NES *init_nes();
 void delete_nes(NES *);
 void dump_nes_info(NES *, char *);
 
-void cpu_write(NES *, uint16_t, uint8_t);
-uint8_t cpu_read(NES *, uint16_t);
+void cpu_write_io(NES *, uint16_t, uint8_t);
+uint8_t cpu_read_io(NES *, uint16_t);
 void ppu_write(NES *, uint16_t, uint8_t);
 uint8_t ppu_read(NES *, uint16_t);
+uint16_t ppu_read_row(NES *, uint16_t);
+void ppu_scanline(NES *);
 
 void oam_dma(NES *, uint8_t);
 
@@ -31,4 +49,21 @@ void load_cartridge(NES *, Cartridge *);
 void reset(NES *);
 void clock(NES *);
 
+static inline uint8_t cpu_read(NES *nes, uint16_t addr)
+{
+	uint8_t *page = nes->read_map[addr >> 8];
+	if (page != NULL)
+		return page[addr & 0xFF];
+	return cpu_read_io(nes, addr);
+}
+
+static inline void cpu_write(NES *nes, uint16_t addr, uint8_t value)
+{
+	uint8_t *page = nes->write_map[addr >> 8];
+	if (page != NULL)
+		page[addr & 0xFF] = value;
+	else
+		cpu_write_io(nes, addr, value);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,272 @@
+#ifndef _OPCODES_H
+#define _OPCODES_H
+
+/*
+The 6502 instruction set as an X-macro: X(opcode, operation, addr_mode, cycles).
+
+Both CPU cores are generated from this one list: cpu.c expands it into the
+function-pointer instruction_table, and cpu_fused.c expands it into one
+fused handler per opcode. Unofficial opcodes are listed as XXX.
+
+full instr set: https://www.masswerk.at/6502/6502_instruction_set.html
+*/
+
+#define OPCODE_TABLE(X) \
+	X(0x00, BRK, implied,         7) \
+	X(0x01, ORA, zero_indirect_x, 6) \
+	X(0x02, XXX, XXX,             2) \
+	X(0x03, XXX, XXX,             2) \
+	X(0x04, XXX, XXX,             2) \
+	X(0x05, ORA, zero_page,       3) \
+	X(0x06, ASL, zero_page,       5) \
+	X(0x07, XXX, XXX,             2) \
+	X(0x08, PHP, implied,         3) \
+	X(0x09, ORA, immediate,       2) \
+	X(0x0A, ASL, accumulator,     2) \
+	X(0x0B, XXX, XXX,             2) \
+	X(0x0C, XXX, XXX,             2) \
+	X(0x0D, ORA, absolute,        4) \
+	X(0x0E, ASL, absolute,        6) \
+	X(0x0F, XXX, XXX,             2) \
+	X(0x10, BPL, relative,        2) \
+	X(0x11, ORA, zero_indirect_y, 5) \
+	X(0x12, XXX, XXX,             2) \
+	X(0x13, XXX, XXX,             2) \
+	X(0x14, XXX, XXX,             2) \
+	X(0x15, ORA, zero_offset_x,   4) \
+	X(0x16, ASL, zero_offset_x,   6) \
+	X(0x17, XXX, XXX,             2) \
+	X(0x18, CLC, implied,         2) \
+	X(0x19, ORA, abs_offset_y,    4) \
+	X(0x1A, XXX, XXX,             2) \
+	X(0x1B, XXX, XXX,             2) \
+	X(0x1C, XXX, XXX,             2) \
+	X(0x1D, ORA, abs_offset_x,    4) \
+	X(0x1E, ASL, abs_offset_x,    7) \
+	X(0x1F, XXX, XXX,             2) \
+	X(0x20, JSR, absolute,        6) \
+	X(0x21, AND, zero_indirect_x, 6) \
+	X(0x22, XXX, XXX,             2) \
+	X(0x23, XXX, XXX,             2) \
+	X(0x24, BIT, zero_page,       3) \
+	X(0x25, AND, zero_page,       3) \
+	X(0x26, ROL, zero_page,       5) \
+	X(0x27, XXX, XXX,             2) \
+	X(0x28, PLP, implied,         4) \
+	X(0x29, AND, immediate,       2) \
+	X(0x2A, ROL, accumulator,     2) \
+	X(0x2B, XXX, XXX,             2) \
+	X(0x2C, BIT, absolute,        4) \
+	X(0x2D, AND, absolute,        4) \
+	X(0x2E, ROL, absolute,        6) \
+	X(0x2F, XXX, XXX,             2) \
+	X(0x30, BMI, relative,        2) \
+	X(0x31, AND, zero_indirect_y, 5) \
+	X(0x32, XXX, XXX,             2) \
+	X(0x33, XXX, XXX,             2) \
+	X(0x34, XXX, XXX,             2) \
+	X(0x35, AND, zero_offset_x,   4) \
+	X(0x36, ROL, zero_offset_x,   6) \
+	X(0x37, XXX, XXX,             2) \
+	X(0x38, SEC, implied,         2) \
+	X(0x39, AND, abs_offset_y,    4) \
+	X(0x3A, XXX, XXX,             2) \
+	X(0x3B, XXX, XXX,             2) \
+	X(0x3C, XXX, XXX,             2) \
+	X(0x3D, AND, abs_offset_x,    4) \
+	X(0x3E, ROL, abs_offset_x,    7) \
+	X(0x3F, XXX, XXX,             2) \
+	X(0x40, RTI, implied,         6) \
+	X(0x41, EOR, zero_indirect_x, 6) \
+	X(0x42, XXX, XXX,             2) \
+	X(0x43, XXX, XXX,             2) \
+	X(0x44, XXX, XXX,             2) \
+	X(0x45, EOR, zero_page,       3) \
+	X(0x46, LSR, zero_page,       5) \
+	X(0x47, XXX, XXX,             2) \
+	X(0x48, PHA, implied,         3) \
+	X(0x49, EOR, immediate,       2) \
+	X(0x4A, LSR, accumulator,     2) \
+	X(0x4B, XXX, XXX,             2) \
+	X(0x4C, JMP, absolute,        3) \
+	X(0x4D, EOR, absolute,        4) \
+	X(0x4E, LSR, absolute,        6) \
+	X(0x4F, XXX, XXX,             2) \
+	X(0x50, BVC, relative,        2) \
+	X(0x51, EOR, zero_indirect_y, 5) \
+	X(0x52, XXX, XXX,             2) \
+	X(0x53, XXX, XXX,             2) \
+	X(0x54, XXX, XXX,             2) \
+	X(0x55, EOR, zero_offset_x,   4) \
+	X(0x56, LSR, zero_offset_x,   6) \
+	X(0x57, XXX, XXX,             2) \
+	X(0x58, CLI, implied,         2) \
+	X(0x59, EOR, abs_offset_y,    4) \
+	X(0x5A, XXX, XXX,             2) \
+	X(0x5B, XXX, XXX,             2) \
+	X(0x5C, XXX, XXX,             2) \
+	X(0x5D, EOR, abs_offset_x,    4) \
+	X(0x5E, LSR, abs_offset_x,    7) \
+	X(0x5F, XXX, XXX,             2) \
+	X(0x60, RTS, implied,         6) \
+	X(0x61, ADC, zero_indirect_x, 6) \
+	X(0x62, XXX, XXX,             2) \
+	X(0x63, XXX, XXX,             2) \
+	X(0x64, XXX, XXX,             2) \
+	X(0x65, ADC, zero_page,       3) \
+	X(0x66, ROR, zero_page,       5) \
+	X(0x67, XXX, XXX,             2) \
+	X(0x68, PLA, implied,         4) \
+	X(0x69, ADC, immediate,       2) \
+	X(0x6A, ROR, accumulator,     2) \
+	X(0x6B, XXX, XXX,             2) \
+	X(0x6C, JMP, indirect,        5) \
+	X(0x6D, ADC, absolute,        4) \
+	X(0x6E, ROR, absolute,        6) \
+	X(0x6F, XXX, XXX,             2) \
+	X(0x70, BVS, relative,        2) \
+	X(0x71, ADC, zero_indirect_y, 5) \
+	X(0x72, XXX, XXX,             2) \
+	X(0x73, XXX, XXX,             2) \
+	X(0x74, XXX, XXX,             2) \
+	X(0x75, ADC, zero_offset_x,   4) \
+	X(0x76, ROR, zero_offset_x,   6) \
+	X(0x77, XXX, XXX,             2) \
+	X(0x78, SEI, implied,         2) \
+	X(0x79, ADC, abs_offset_y,    4) \
+	X(0x7A, XXX, XXX,             2) \
+	X(0x7B, XXX, XXX,             2) \
+	X(0x7C, XXX, XXX,             2) \
+	X(0x7D, ADC, abs_offset_x,    4) \
+	X(0x7E, ROR, abs_offset_x,    7) \
+	X(0x7F, XXX, XXX,             2) \
+	X(0x80, XXX, XXX,             2) \
+	X(0x81, STA, zero_indirect_x, 6) \
+	X(0x82, XXX, XXX,             2) \
+	X(0x83, XXX, XXX,             2) \
+	X(0x84, STY, zero_page,       3) \
+	X(0x85, STA, zero_page,       3) \
+	X(0x86, STX, zero_page,       3) \
+	X(0x87, XXX, XXX,             2) \
+	X(0x88, DEY, implied,         2) \
+	X(0x89, XXX, XXX,             2) \
+	X(0x8A, TXA, implied,         2) \
+	X(0x8B, XXX, XXX,             2) \
+	X(0x8C, STY, absolute,        4) \
+	X(0x8D, STA, absolute,        4) \
+	X(0x8E, STX, absolute,        4) \
+	X(0x8F, XXX, XXX,             2) \
+	X(0x90, BCC, relative,        2) \
+	X(0x91, STA, zero_indirect_y, 6) \
+	X(0x92, XXX, XXX,             2) \
+	X(0x93, XXX, XXX,             2) \
+	X(0x94, STY, zero_offset_x,   4) \
+	X(0x95, STA, zero_offset_x,   4) \
+	X(0x96, STX, zero_offset_y,   4) \
+	X(0x97, XXX, XXX,             2) \
+	X(0x98, TYA, implied,         2) \
+	X(0x99, STA, abs_offset_y,    5) \
+	X(0x9A, TXS, implied,         2) \
+	X(0x9B, XXX, XXX,             2) \
+	X(0x9C, XXX, XXX,             2) \
+	X(0x9D, STA, abs_offset_x,    5) \
+	X(0x9E, XXX, XXX,             2) \
+	X(0x9F, XXX, XXX,             2) \
+	X(0xA0, LDY, immediate,       2) \
+	X(0xA1, LDA, zero_indirect_x, 6) \
+	X(0xA2, LDX, immediate,       2) \
+	X(0xA3, XXX, XXX,             2) \
+	X(0xA4, LDY, zero_page,       3) \
+	X(0xA5, LDA, zero_page,       3) \
+	X(0xA6, LDX, zero_page,       3) \
+	X(0xA7, XXX, XXX,             2) \
+	X(0xA8, TAY, implied,         2) \
+	X(0xA9, LDA, immediate,       2) \
+	X(0xAA, TAX, implied,         2) \
+	X(0xAB, XXX, XXX,             2) \
+	X(0xAC, LDY, absolute,        4) \
+	X(0xAD, LDA, absolute,        4) \
+	X(0xAE, LDX, absolute,        4) \
+	X(0xAF, XXX, XXX,             2) \
+	X(0xB0, BCS, relative,        2) \
+	X(0xB1, LDA, zero_indirect_y, 5) \
+	X(0xB2, XXX, XXX,             2) \
+	X(0xB3, XXX, XXX,             2) \
+	X(0xB4, LDY, zero_offset_x,   4) \
+	X(0xB5, LDA, zero_offset_x,   4) \
+	X(0xB6, LDX, zero_offset_y,   4) \
+	X(0xB7, XXX, XXX,             2) \
+	X(0xB8, CLV, implied,         2) \
+	X(0xB9, LDA, abs_offset_y,    4) \
+	X(0xBA, TSX, implied,         2) \
+	X(0xBB, XXX, XXX,             2) \
+	X(0xBC, LDY, abs_offset_x,    4) \
+	X(0xBD, LDA, abs_offset_x,    4) \
+	X(0xBE, LDX, abs_offset_y,    4) \
+	X(0xBF, XXX, XXX,             2) \
+	X(0xC0, CPY, immediate,       2) \
+	X(0xC1, CMP, zero_indirect_x, 6) \
+	X(0xC2, XXX, XXX,             2) \
+	X(0xC3, XXX, XXX,             2) \
+	X(0xC4, CPY, zero_page,       3) \
+	X(0xC5, CMP, zero_page,       3) \
+	X(0xC6, DEC, zero_page,       5) \
+	X(0xC7, XXX, XXX,             2) \
+	X(0xC8, INY, implied,         2) \
+	X(0xC9, CMP, immediate,       2) \
+	X(0xCA, DEX, implied,         2) \
+	X(0xCB, XXX, XXX,             2) \
+	X(0xCC, CPY, absolute,        4) \
+	X(0xCD, CMP, absolute,        4) \
+	X(0xCE, DEC, absolute,        6) \
+	X(0xCF, XXX, XXX,             2) \
+	X(0xD0, BNE, relative,        2) \
+	X(0xD1, CMP, zero_indirect_y, 5) \
+	X(0xD2, XXX, XXX,             2) \
+	X(0xD3, XXX, XXX,             2) \
+	X(0xD4, XXX, XXX,             2) \
+	X(0xD5, CMP, zero_offset_x,   4) \
+	X(0xD6, DEC, zero_offset_x,   6) \
+	X(0xD7, XXX, XXX,             2) \
+	X(0xD8, CLD, implied,         2) \
+	X(0xD9, CMP, abs_offset_y,    4) \
+	X(0xDA, XXX, XXX,             2) \
+	X(0xDB, XXX, XXX,             2) \
+	X(0xDC, XXX, XXX,             2) \
+	X(0xDD, CMP, abs_offset_x,    4) \
+	X(0xDE, DEC, abs_offset_x,    7) \
+	X(0xDF, XXX, XXX,             2) \
+	X(0xE0, CPX, immediate,       2) \
+	X(0xE1, SBC, zero_indirect_x, 6) \
+	X(0xE2, XXX, XXX,             2) \
+	X(0xE3, XXX, XXX,             2) \
+	X(0xE4, CPX, zero_page,       3) \
+	X(0xE5, SBC, zero_page,       3) \
+	X(0xE6, INC, zero_page,       5) \
+	X(0xE7, XXX, XXX,             2) \
+	X(0xE8, INX, implied,         2) \
+	X(0xE9, SBC, immediate,       2) \
+	X(0xEA, NOP, implied,         2) \
+	X(0xEB, XXX, XXX,             2) \
+	X(0xEC, CPX, absolute,        4) \
+	X(0xED, SBC, absolute,        4) \
+	X(0xEE, INC, absolute,        6) \
+	X(0xEF, XXX, XXX,             2) \
+	X(0xF0, BEQ, relative,        2) \
+	X(0xF1, SBC, zero_indirect_y, 5) \
+	X(0xF2, XXX, XXX,             2) \
+	X(0xF3, XXX, XXX,             2) \
+	X(0xF4, XXX, XXX,             2) \
+	X(0xF5, SBC, zero_offset_x,   4) \
+	X(0xF6, INC, zero_offset_x,   6) \
+	X(0xF7, XXX, XXX,             2) \
+	X(0xF8, SED, implied,         2) \
+	X(0xF9, SBC, abs_offset_y,    4) \
+	X(0xFA, XXX, XXX,             2) \
+	X(0xFB, XXX, XXX,             2) \
+	X(0xFC, XXX, XXX,             2) \
+	X(0xFD, SBC, abs_offset_x,    4) \
+	X(0xFE, INC, abs_offset_x,    7) \
+	X(0xFF, XXX, XXX,             2)
+
+#endif
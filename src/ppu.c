@@ -4,199 +4,251 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Four 2-bit pixels of an interleaved pattern row (see cart_chr_row), the
+// leftmost in the top bits, spread out to one byte each in memory order
+static uint32_t pixel_quads[256];
+
+static void build_pixel_quads()
+{
+	for (int q = 0; q < 256; q++)
+	{
+		uint8_t pixels[4];
+		for (int i = 0; i < 4; i++)
+			pixels[i] = (q >> (6 - 2 * i)) & 0x03;
+		memcpy(&pixel_quads[q], pixels, sizeof(pixels));
+	}
+}
+
 PPU *init_ppu()
 {
-	PPU *ppu = malloc(sizeof(PPU));
+	if (pixel_quads[0xFF] == 0)
+		build_pixel_quads();
+
+	PPU *ppu = calloc(1, sizeof(PPU));
+	ppu_set_mirroring(ppu, HORIZONTAL);
 	return ppu;
 }
 
 void reset_ppu(PPU *ppu)
 {
+	// keep the system reference and the mirroring across resets
+	NES *nes = ppu->nes;
+	uint8_t *nt_map[4];
+	memcpy(nt_map, ppu->nt_map, sizeof(nt_map));
+
 	memset(ppu, 0, sizeof(PPU));
+	ppu->nes = nes;
+	memcpy(ppu->nt_map, nt_map, sizeof(nt_map));
 }
 
-uint8_t color_table[][3] = {
-	{ 84,  84,  84}, {  0,  30, 116}, {  8,  16, 144}, { 48,   0, 136}, { 68,   0, 100}, { 92,   0,  48}, { 84,   4,   0}, { 60,  24,   0}, { 32,  42,   0}, {  8,  58,   0}, {  0,  64,   0}, {  0,  60,   0}, {  0,  50,  60}, {  0,   0,   0}, {  0,   0,   0}, {  0,   0,   0},
-	{152, 150, 152}, {  8,  76, 196}, { 48,  50, 236}, { 92,  30, 228}, {136,  20, 176}, {160,  20, 100}, {152,  34,  32}, {120,  60,   0}, { 84,  90,   0}, { 40, 114,   0}, {  8, 124,   0}, {  0, 118,  40}, {  0, 102, 120}, {  0,   0,   0}, {  0,   0,   0}, {  0,   0,   0},
-	{236, 238, 236}, { 76, 154, 236}, {120, 124, 236}, {176,  98, 236}, {228,  84, 236}, {236,  88, 180}, {236, 106, 100}, {212, 136,  32}, {160, 170,   0}, {116, 196,   0}, { 76, 208,  32}, { 56, 204, 108}, { 56, 180, 204}, { 60,  60,  60}, {  0,   0,   0}, {  0,   0,   0},
-	{236, 238, 236}, {168, 204, 236}, {188, 188, 236}, {212, 178, 236}, {236, 174, 236}, {236, 174, 212}, {236, 180, 176}, {228, 196, 144}, {204, 210, 120}, {180, 222, 120}, {168, 226, 144}, {152, 226, 180}, {160, 214, 228}, {160, 162, 160}, {  0,   0,   0}, {  0,   0,   0}
-};
-
-uint8_t get_ppumask(PPU *ppu)
+// Points the four logical nametables at VRAM. Called when a cartridge is
+// loaded and whenever a mapper switches mirroring
+void ppu_set_mirroring(PPU *ppu, Mirroring mirroring)
 {
-	uint8_t result = 0x00;
-	result |= ppu->mask.greyscale << 0;
-	result |= ppu->mask.render_bg_left << 1;
-	result |= ppu->mask.render_sprites_left << 2;
-	result |= ppu->mask.render_bg << 3;
-	result |= ppu->mask.render_sprites << 4;
-	result |= ppu->mask.emph_red << 5;
-	result |= ppu->mask.emph_green << 6;
-	result |= ppu->mask.emph_blue << 7;
-	return result;
+	static const uint8_t layouts[][4] = {
+		[VERTICAL]           = { 0, 1, 0, 1 },
+		[HORIZONTAL]         = { 0, 0, 1, 1 },
+		[FOUR_SCREEN]        = { 0, 1, 2, 3 },
+		[SINGLE_SCREEN_LOW]  = { 0, 0, 0, 0 },
+		[SINGLE_SCREEN_HIGH] = { 1, 1, 1, 1 },
+	};
+
+	for (int i = 0; i < 4; i++)
+		ppu->nt_map[i] = ppu->nametable[layouts[mirroring][i]];
 }
 
-void set_ppumask(PPU *ppu, uint8_t value)
+// inc_scroll_x/inc_scroll_y on a loopy address
+static uint16_t loopy_inc_x(uint16_t v)
 {
-	ppu->mask.greyscale = value & 1 << 0 ? 1 : 0;
-	ppu->mask.render_bg_left = value & 1 << 1 ? 1 : 0;
-	ppu->mask.render_sprites_left = value & 1 << 2 ? 1 : 0;
-	ppu->mask.render_bg = value & 1 << 3 ? 1 : 0;
-	ppu->mask.render_sprites = value & 1 << 4 ? 1 : 0;
-	ppu->mask.emph_red = value & 1 << 5 ? 1 : 0;
-	ppu->mask.emph_green = value & 1 << 6 ? 1 : 0;
-	ppu->mask.emph_blue = value & 1 << 7 ? 1 : 0;
+	// Each nametable is 32x30 tiles, so if we are at an edge
+	// we need to wrap x position around to 0 and flip table number
+	if (loopy_coarse_x(v) == 31)
+		return (v & ~LOOPY_COARSE_X) ^ LOOPY_NAMETABLE_X;
+	return v + 1;
 }
 
-uint8_t get_ppuctrl(PPU *ppu)
+static uint16_t loopy_inc_y(uint16_t v)
 {
-	uint8_t result = 0x00;
-	result |= ppu->ctrl.nametable_x << 0;
-	result |= ppu->ctrl.nametable_y << 1;
-	result |= ppu->ctrl.increment_mode << 2;
-	result |= ppu->ctrl.pattern_sprite << 3;
-	result |= ppu->ctrl.pattern_background << 4;
-	result |= ppu->ctrl.sprite_size << 5;
-	result |= ppu->ctrl.slave_mode << 6;
-	result |= ppu->ctrl.enable_nmi << 7;
-	return result;
+	if (loopy_fine_y(v) < 7)
+		return v + 0x1000;
+
+	v &= ~LOOPY_FINE_Y;
+	// rows 30 and 31 hold attributes; scrolling into them wraps without
+	// switching nametables
+	if (loopy_coarse_y(v) == 29)
+		return (v & ~LOOPY_COARSE_Y) ^ LOOPY_NAMETABLE_Y;
+	if (loopy_coarse_y(v) == 31)
+		return v & ~LOOPY_COARSE_Y;
+	return v + 0x0020;
 }
 
-void set_ppuctrl(PPU *ppu, uint8_t value)
+void inc_scroll_x(PPU *ppu)
 {
-	ppu->ctrl.nametable_x = value & (1 << 0) ? 1 : 0;
-	ppu->ctrl.nametable_y = value & (1 << 1) ? 1 : 0;
-	ppu->ctrl.increment_mode = value & (1 << 2) ? 1 : 0;
-	ppu->ctrl.pattern_sprite = value & (1 << 3) ? 1 : 0;
-	ppu->ctrl.pattern_background = value & (1 << 4) ? 1 : 0;
-	ppu->ctrl.sprite_size = value & (1 << 5) ? 1 : 0;
-	ppu->ctrl.slave_mode = value & (1 << 6) ? 1 : 0;
-	ppu->ctrl.enable_nmi = value & (1 << 7) ? 1 : 0;
+	if (ppu_rendering(ppu))
+		ppu->vram_addr = loopy_inc_x(ppu->vram_addr);
 }
 
-uint8_t get_ppustatus(PPU *ppu)
+void inc_scroll_y(PPU *ppu)
 {
-	uint8_t result = 0x00;
-	result |= ppu->status.sprite_overflow << 5;
-	result |= ppu->status.sprite_zero_hit << 6;
-	result |= ppu->status.vertical_blank << 7;
-	return result;
+	if (ppu_rendering(ppu))
+		ppu->vram_addr = loopy_inc_y(ppu->vram_addr);
 }
 
-void set_ppustatus(PPU *ppu, uint8_t value)
+void trans_addr_x(PPU *ppu)
 {
-	ppu->status.sprite_overflow = value & (1 << 5) ? 1 : 0;
-	ppu->status.sprite_zero_hit = value & (1 << 6) ? 1 : 0;
-	ppu->status.vertical_blank = value & (1 << 7) ? 1 : 0;
+	if (ppu_rendering(ppu))
+		ppu->vram_addr = (ppu->vram_addr & ~LOOPY_HORIZONTAL) | (ppu->tram_addr & LOOPY_HORIZONTAL);
 }
 
-uint16_t get_loopyregister(LoopyRegister *reg) 
+void trans_addr_y(PPU *ppu)
 {
-	uint16_t value = 0x0000;
-	value |= (reg->coarse_x    << 0 ) & 0b0000000000011111;
-	value |= (reg->coarse_y    << 5 ) & 0b0000001111100000;
-	value |= (reg->nametable_x << 10) & 0b0000010000000000;
-	value |= (reg->nametable_y << 11) & 0b0000100000000000;
-	value |= (reg->fine_y      << 12) & 0b0111000000000000;
-	return value;
+	if (ppu_rendering(ppu))
+		ppu->vram_addr = (ppu->vram_addr & ~LOOPY_VERTICAL) | (ppu->tram_addr & LOOPY_VERTICAL);
 }
 
-void set_loopyregister(LoopyRegister *reg, uint16_t value) 
+void load_bg_shift(PPU *ppu)
 {
-	reg->coarse_x    = (value >> 0 ) & 0b0000000000011111;
-	reg->coarse_y    = (value >> 5 ) & 0b0000000000011111;
-	reg->nametable_x = (value >> 10) & 0b0000000000000001;
-	reg->nametable_y = (value >> 11) & 0b0000000000000001;
-	reg->fine_y      = (value >> 12) & 0b0000000000000111;
+	ppu->bg_shifter_pattern_lo = (ppu->bg_shifter_pattern_lo & 0xFF00) | ppu->bg_next_tile_lsb;
+	ppu->bg_shifter_pattern_hi = (ppu->bg_shifter_pattern_hi & 0xFF00) | ppu->bg_next_tile_msb;
+
+	ppu->bg_shifter_attrib_lo  = (ppu->bg_shifter_attrib_lo & 0xFF00) | ((ppu->bg_next_tile_attrib & 0b01) ? 0xFF : 0x00);
+	ppu->bg_shifter_attrib_hi  = (ppu->bg_shifter_attrib_hi & 0xFF00) | ((ppu->bg_next_tile_attrib & 0b10) ? 0xFF : 0x00);
 }
 
-void inc_scroll_x(PPU *ppu)
+void update_shifters(PPU *ppu)
 {
-	if (ppu->mask.render_bg || ppu->mask.render_sprites) 
+	if (ppu->mask & MASK_BG) 
 	{
-		if (ppu->vram_addr.coarse_x == 31)
-		{
-			// Each nametable is 32x30 tiles, so if we are at an edge
-			// we need to wrap x position around to 0 and flip table number
-			ppu->vram_addr.coarse_x = 0;
-			ppu->vram_addr.nametable_x = ppu->vram_addr.nametable_x ? 0 : 1;
-		}
-		else
-		{
-			ppu->vram_addr.coarse_x++;
-		}
+		// Shifting background tile pattern row
+		ppu->bg_shifter_pattern_lo <<= 1;
+		ppu->bg_shifter_pattern_hi <<= 1;
+
+		// Shifting palette attributes by 1
+		ppu->bg_shifter_attrib_lo <<= 1;
+		ppu->bg_shifter_attrib_hi <<= 1;
 	}
 }
 
-void inc_scroll_y(PPU *ppu)
+#define DOTS_PER_LINE 341
+#define SCANLINE_DOT  260  // dot ppu_scanline is called on
+
+// Position of a dot within the frame, counting from the pre-render line
+static int32_t frame_position(int16_t scanline, int16_t cycle)
 {
-	if (ppu->mask.render_bg || ppu->mask.render_sprites) 
-	{
-		if (ppu->vram_addr.fine_y < 7)
-		{
-			ppu->vram_addr.fine_y++;
-		}
-		else
-		{
-			ppu->vram_addr.fine_y = 0;
+	return (scanline + 1) * DOTS_PER_LINE + cycle;
+}
 
-			if (ppu->vram_addr.coarse_y == 29)
-			{
-				ppu->vram_addr.coarse_y = 0;
-				ppu->vram_addr.nametable_y = ppu->vram_addr.nametable_y ? 0 : 1;
-			}
-			else if (ppu->vram_addr.coarse_y == 31)
-			{
-				ppu->vram_addr.coarse_y = 0;
-			}
-			else
-			{
-				ppu->vram_addr.coarse_y++;
-			}
-		}
-	}
+static uint8_t sprite_height(const PPU *ppu)
+{
+	return ppu->ctrl & CTRL_SPRITE_SIZE ? 16 : 8;
 }
 
-void trans_addr_x(PPU *ppu)
+// First dot at or after `pos` on which sprite 0 could hit the background,
+// going by where sprite 0 is. It may come early (the background can be
+// transparent there) but never late
+static int32_t next_sprite_zero_dot(const PPU *ppu, int32_t pos)
 {
-	if (ppu->mask.render_bg || ppu->mask.render_sprites) 
+	if ((ppu->status & STATUS_SPRITE_ZERO) || (ppu->mask & MASK_RENDERING) != MASK_RENDERING)
+		return INT32_MAX;
+
+	int top = ppu->oam_memory[0] + 1;
+	int first = ppu->oam_memory[3] + 1;  // dot of the leftmost pixel
+	int last = first + 7 < 255 ? first + 7 : 255;  // never hits at x = 255
+
+	for (int line = top; line < top + sprite_height(ppu) && line < NES_RES_HEIGHT && first <= last; line++)
 	{
-		ppu->vram_addr.nametable_x = ppu->tram_addr.nametable_x;
-		ppu->vram_addr.coarse_x    = ppu->tram_addr.coarse_x;
+		if (pos <= frame_position(line, first))
+			return frame_position(line, first);
+		if (pos <= frame_position(line, last))
+			return pos;
 	}
+	return INT32_MAX;
 }
 
-void trans_addr_y(PPU *ppu)
+// Dot at or after `pos` on which sprite evaluation sets the overflow flag
+static int32_t next_overflow_dot(const PPU *ppu, int32_t pos)
 {
-	if (ppu->mask.render_bg || ppu->mask.render_sprites) 
+	if ((ppu->status & STATUS_OVERFLOW) || !ppu_rendering(ppu))
+		return INT32_MAX;
+
+	// sprites starting minus sprites ending on each line
+	int8_t delta[NES_RES_HEIGHT + 1] = {0};
+	uint8_t height = sprite_height(ppu);
+	for (int i = 0; i < 64; i++)
 	{
-		ppu->vram_addr.fine_y      = ppu->tram_addr.fine_y;
-		ppu->vram_addr.nametable_y = ppu->tram_addr.nametable_y;
-		ppu->vram_addr.coarse_y    = ppu->tram_addr.coarse_y;
+		int top = ppu->oam_memory[i * 4] + 1;
+		if (top >= NES_RES_HEIGHT)
+			continue;
+		delta[top]++;
+		delta[top + height < NES_RES_HEIGHT ? top + height : NES_RES_HEIGHT]--;
 	}
+
+	int count = 0;
+	for (int line = 0; line < NES_RES_HEIGHT; line++)
+	{
+		count += delta[line];
+		if (count > 8 && pos <= frame_position(line - 1, 257))
+			return frame_position(line - 1, 257);
+	}
+	return INT32_MAX;
 }
 
-void load_bg_shift(PPU *ppu)
+// ppu_clock calls from `pos` up to and including `event`
+static uint32_t dots_between(int32_t pos, int32_t event)
 {
-	ppu->bg_shifter_pattern_lo = (ppu->bg_shifter_pattern_lo & 0xFF00) | ppu->bg_next_tile_lsb;
-	ppu->bg_shifter_pattern_hi = (ppu->bg_shifter_pattern_hi & 0xFF00) | ppu->bg_next_tile_msb;
+	const int32_t skipped_pos = frame_position(0, 0);
+	int32_t dots = event - pos + 1;
 
-	ppu->bg_shifter_attrib_lo  = (ppu->bg_shifter_attrib_lo & 0xFF00) | ((ppu->bg_next_tile_attrib & 0b01) ? 0xFF : 0x00);
-	ppu->bg_shifter_attrib_hi  = (ppu->bg_shifter_attrib_hi & 0xFF00) | ((ppu->bg_next_tile_attrib & 0b10) ? 0xFF : 0x00);
+	// dot (0, 0) is skipped by ppu_clock, so reaching past it takes one call less
+	if (pos <= skipped_pos && event > skipped_pos)
+		dots--;
+	return (uint32_t)dots;
 }
 
-void update_shifters(PPU *ppu)
+/*
+Number of ppu_clock calls until the next dot whose effects the CPU can
+observe, or that changes what a PPUSTATUS read returns: the end of
+vertical blank on the pre-render line, the start of vertical blank (and
+its NMI), the end of the frame, and the dots that may set the sprite 0
+hit or sprite overflow flags. The scheduler in nes.c runs the CPU up to
+that point before catching the PPU up.
+*/
+uint32_t ppu_dots_to_event(const PPU *ppu)
 {
-	if (ppu->mask.render_bg) 
-	{
-		// Shifting background tile pattern row
-		ppu->bg_shifter_pattern_lo <<= 1;
-		ppu->bg_shifter_pattern_hi <<= 1;
+	const int32_t vblank_end_pos = frame_position(-1, 1);
+	const int32_t vblank_pos = frame_position(241, 1);
+	const int32_t frame_end_pos = frame_position(260, 340);
 
-		// Shifting palette attributes by 1
-		ppu->bg_shifter_attrib_lo <<= 1;
-		ppu->bg_shifter_attrib_hi <<= 1;
-	}
+	int32_t pos = frame_position(ppu->scanline, ppu->cycle);
+	int32_t event = pos <= vblank_end_pos ? vblank_end_pos : pos <= vblank_pos ? vblank_pos : frame_end_pos;
+
+	int32_t sprite_event = next_sprite_zero_dot(ppu, pos);
+	if (sprite_event < event)
+		event = sprite_event;
+	sprite_event = next_overflow_dot(ppu, pos);
+	if (sprite_event < event)
+		event = sprite_event;
+
+	return dots_between(pos, event);
+}
+
+/*
+Number of ppu_clock calls until the cartridge is told about the `n`th
+scanline from here (n = 1 is the next one), or UINT32_MAX if that won't
+happen in this frame. Rendered lines, the pre-render line included, are
+reported on dot 260, which is about when the PPU moves on to sprite
+patterns and MMC3 style counters see PPU A12 rise.
+*/
+uint32_t ppu_dots_to_scanline(const PPU *ppu, uint32_t n)
+{
+	if (!ppu_rendering(ppu) || n == 0 || ppu->scanline >= NES_RES_HEIGHT)
+		return UINT32_MAX;
+
+	int32_t line = ppu->cycle <= SCANLINE_DOT ? ppu->scanline : ppu->scanline + 1;
+	if (n > (uint32_t)(NES_RES_HEIGHT - line))
+		return UINT32_MAX;
+	line += n - 1;
+	return dots_between(frame_position(ppu->scanline, ppu->cycle), frame_position(line, SCANLINE_DOT));
 }
 
 static bool on_screen(const PPU *ppu)
@@ -210,6 +262,95 @@ static bool on_screen(const PPU *ppu)
 }
 
 uint8_t ppu_read(NES *, uint16_t);
+uint16_t ppu_read_row(NES *, uint16_t);
+void ppu_scanline(NES *);
+
+// sprite_line entries; 0 means no sprite pixel
+#define SPRITE_PIXEL   0x03  // 2-bit pattern value
+#define SPRITE_PALETTE 0x0C  // sprite palette 0-3
+#define SPRITE_BEHIND  0x10  // drawn behind the background
+#define SPRITE_ZERO    0x20  // pixel belongs to sprite 0
+
+/*
+Sprite evaluation for `line`, done in one go at dot 257 of the line before,
+where the real PPU fetches the sprite patterns: the first 8 sprites on the
+line are copied to secondary OAM, a 9th sets the overflow flag, and their
+pixels are drawn into sprite_line. Sprites earlier in OAM win over later
+ones whatever their priority bit says, so a pixel is only drawn where no
+earlier sprite left an opaque one.
+*/
+static void evaluate_sprites(PPU *ppu, int16_t line)
+{
+	uint8_t height = sprite_height(ppu);
+	bool zero = false;
+
+	memset(ppu->sprite_line, 0, sizeof(ppu->sprite_line));
+	ppu->sprite_count = 0;
+	ppu->sprite_zero_on_line = false;
+	if (!ppu_rendering(ppu))
+		return;
+
+	for (int i = 0; i < 64; i++)
+	{
+		const uint8_t *sprite = &ppu->oam_memory[i * 4];
+		int row = line - (sprite[0] + 1);
+
+		if (row < 0 || row >= height)
+			continue;
+		if (ppu->sprite_count == 8) {
+			ppu->status |= STATUS_OVERFLOW;
+			break;
+		}
+		if (i == 0)
+			zero = ppu->sprite_zero_on_line = true;
+		memcpy(&ppu->secondary_oam[ppu->sprite_count++ * 4], sprite, 4);
+	}
+
+	for (int s = 0; s < ppu->sprite_count; s++)
+	{
+		const uint8_t *sprite = &ppu->secondary_oam[s * 4];
+		uint8_t tile = sprite[1];
+		uint8_t attrib = sprite[2];
+		int row = line - (sprite[0] + 1);
+		uint16_t addr;
+
+		if (attrib & 0x80)
+			row = height - 1 - row;
+		if (height == 16)
+			addr = (tile & 0x01) << 12 | ((tile & 0xFE) + (row >> 3)) << 4 | (row & 0x07);
+		else
+			addr = (ppu->ctrl & CTRL_SPRITE_TABLE ? 0x1000 : 0) | tile << 4 | row;
+
+		uint16_t pattern = ppu_read_row(ppu->nes, addr);
+		uint8_t bits = (attrib & 0x03) << 2 | (attrib & 0x20 ? SPRITE_BEHIND : 0) | (s == 0 && zero ? SPRITE_ZERO : 0);
+
+		for (int p = 0; p < 8 && sprite[3] + p < NES_RES_WIDTH; p++)
+		{
+			// pixel p sits at bits 14-2p, mirrored when flipped horizontally
+			uint8_t pixel = (pattern >> (attrib & 0x40 ? 2 * p : 14 - 2 * p)) & SPRITE_PIXEL;
+			uint8_t *out = &ppu->sprite_line[sprite[3] + p];
+
+			if (pixel && !(*out & SPRITE_PIXEL))
+				*out = bits | pixel;
+		}
+	}
+}
+
+// Combines a background pixel (palette << 2 | pixel, 0 when transparent)
+// with the sprite pixel at `x`, returning the palette RAM offset to show
+static uint8_t merge_sprite(PPU *ppu, int x, uint8_t bg)
+{
+	uint8_t sprite = ppu->sprite_line[x];
+
+	if (!(sprite & SPRITE_PIXEL) || !(ppu->mask & MASK_SPRITES) || (x < 8 && !(ppu->mask & MASK_SPRITES_LEFT)))
+		return bg;
+	if (bg == 0)
+		return 0x10 | (sprite & (SPRITE_PALETTE | SPRITE_PIXEL));
+
+	if ((sprite & SPRITE_ZERO) && x != 255)
+		ppu->status |= STATUS_SPRITE_ZERO;
+	return sprite & SPRITE_BEHIND ? bg : 0x10 | (sprite & (SPRITE_PALETTE | SPRITE_PIXEL));
+}
 
 void ppu_clock(PPU *ppu)
 {
@@ -222,10 +363,13 @@ void ppu_clock(PPU *ppu)
 
 		if (ppu->scanline == -1 && ppu->cycle == 1)
 		{
-			ppu->status.vertical_blank = 0;
+			ppu->status &= ~(STATUS_VBLANK | STATUS_SPRITE_ZERO | STATUS_OVERFLOW);
 		}
 
-		if ((ppu->cycle >= 2 && ppu->cycle < 258) || (ppu->cycle >= 321 && ppu->cycle < 338))
+		// with rendering off the PPU fetches nothing at all
+		bool fetching = ppu_rendering(ppu);
+
+		if (fetching && ((ppu->cycle >= 2 && ppu->cycle < 258) || (ppu->cycle >= 321 && ppu->cycle < 338)))
 		{
 			update_shifters(ppu);
 
@@ -234,30 +378,29 @@ void ppu_clock(PPU *ppu)
 				case 0:
 					load_bg_shift(ppu);
 
-					ppu->bg_next_tile_id = ppu_read(ppu->nes, 0x2000 | (get_loopyregister(&ppu->vram_addr) & 0x0FFF));
+					ppu->bg_next_tile_id = ppu_read(ppu->nes, 0x2000 | (ppu->vram_addr & 0x0FFF));
 
 					break;
 				case 2:
-					ppu->bg_next_tile_attrib = ppu_read(ppu->nes, 0x23C0 | (ppu->vram_addr.nametable_y << 11) 
-						                                 | (ppu->vram_addr.nametable_x << 10) 
-						                                 | ((ppu->vram_addr.coarse_y >> 2) << 3) 
-						                                 | (ppu->vram_addr.coarse_x >> 2));
+					ppu->bg_next_tile_attrib = ppu_read(ppu->nes, 0x23C0 | (ppu->vram_addr & (LOOPY_NAMETABLE_X | LOOPY_NAMETABLE_Y))
+						                                 | ((loopy_coarse_y(ppu->vram_addr) >> 2) << 3) 
+						                                 | (loopy_coarse_x(ppu->vram_addr) >> 2));
 					
-					if (ppu->vram_addr.coarse_y & 0x02) ppu->bg_next_tile_attrib >>= 4;
-					if (ppu->vram_addr.coarse_x & 0x02) ppu->bg_next_tile_attrib >>= 2;
+					if (loopy_coarse_y(ppu->vram_addr) & 0x02) ppu->bg_next_tile_attrib >>= 4;
+					if (loopy_coarse_x(ppu->vram_addr) & 0x02) ppu->bg_next_tile_attrib >>= 2;
 					ppu->bg_next_tile_attrib &= 0x03;
 					break;
 
 				case 4: 
-					ppu->bg_next_tile_lsb = ppu_read(ppu->nes, (ppu->ctrl.pattern_background << 12) 
+					ppu->bg_next_tile_lsb = ppu_read(ppu->nes, (ppu->ctrl & CTRL_BG_TABLE ? 0x1000 : 0) 
 						                       + ((uint16_t)ppu->bg_next_tile_id << 4) 
-						                       + (ppu->vram_addr.fine_y) + 0);
+						                       + loopy_fine_y(ppu->vram_addr) + 0);
 
 					break;
 				case 6:
-					ppu->bg_next_tile_msb = ppu_read(ppu->nes, (ppu->ctrl.pattern_background << 12)
+					ppu->bg_next_tile_msb = ppu_read(ppu->nes, (ppu->ctrl & CTRL_BG_TABLE ? 0x1000 : 0)
 						                       + ((uint16_t)ppu->bg_next_tile_id << 4)
-						                       + (ppu->vram_addr.fine_y) + 8);
+						                       + loopy_fine_y(ppu->vram_addr) + 8);
 					break;
 				case 7:
 					inc_scroll_x(ppu);
@@ -273,13 +416,19 @@ void ppu_clock(PPU *ppu)
 
 		if (ppu->cycle == 257)
 		{
-			load_bg_shift(ppu);
+			if (fetching)
+				load_bg_shift(ppu);
 			trans_addr_x(ppu);
+			if (ppu->scanline < NES_RES_HEIGHT - 1)
+				evaluate_sprites(ppu, ppu->scanline + 1);
 		}
 
-		if (ppu->cycle == 338 || ppu->cycle == 340)
+		if (fetching && ppu->cycle == SCANLINE_DOT)
+			ppu_scanline(ppu->nes);
+
+		if (fetching && (ppu->cycle == 338 || ppu->cycle == 340))
 		{
-			ppu->bg_next_tile_id = ppu_read(ppu->nes, 0x2000 | (get_loopyregister(&ppu->vram_addr) & 0x0FFF));
+			ppu->bg_next_tile_id = ppu_read(ppu->nes, 0x2000 | (ppu->vram_addr & 0x0FFF));
 		}
 
 
@@ -293,51 +442,41 @@ void ppu_clock(PPU *ppu)
 	{
 		if (ppu->scanline == 241 && ppu->cycle == 1)
 		{
-			ppu->status.vertical_blank = 1;
+			ppu->status |= STATUS_VBLANK;
 
-			if (ppu->ctrl.enable_nmi) 
+			if (ppu->ctrl & CTRL_NMI) 
 				ppu->nmi = true;
 		}
 	}
 	uint8_t bg_pixel = 0x00; 
 	uint8_t bg_palette = 0x00;
 
-	if (ppu->mask.render_bg)
+	if (ppu->mask & MASK_BG)
 	{
-		uint16_t bit_mux = 0x8000 >> ppu->fine_x;
+		// fine x picks the bit; it is the same one in all four shifters
+		int bit = 15 - ppu->fine_x;
 
-		uint8_t p0_pixel = (ppu->bg_shifter_pattern_lo & bit_mux) > 0;
-		uint8_t p1_pixel = (ppu->bg_shifter_pattern_hi & bit_mux) > 0;
-
-		bg_pixel = (p1_pixel << 1) | p0_pixel;
-
-		uint8_t bg_pal0 = (ppu->bg_shifter_attrib_lo & bit_mux) > 0;
-		uint8_t bg_pal1 = (ppu->bg_shifter_attrib_hi & bit_mux) > 0;
-		bg_palette = (bg_pal1 << 1) | bg_pal0;
+		bg_pixel = ((ppu->bg_shifter_pattern_hi >> bit) & 1) << 1 | ((ppu->bg_shifter_pattern_lo >> bit) & 1);
+		bg_palette = ((ppu->bg_shifter_attrib_hi >> bit) & 1) << 1 | ((ppu->bg_shifter_attrib_lo >> bit) & 1);
 	}
-	uint32_t idx;
 	bool c;
 	if (c = on_screen(ppu)) 
 	{
-		idx = (ppu->scanline * NES_RES_WIDTH + ppu->cycle - 1) * 4;
-		uint8_t *rgb = color_table[ppu_read(ppu->nes, 0x3F00 + (bg_palette << 2) + bg_pixel) & 0x3F];
-		ppu->frame_pixels[idx]     = rgb[0];  // R
-		ppu->frame_pixels[idx + 1] = rgb[1];  // G
-		ppu->frame_pixels[idx + 2] = rgb[2];  // B
-		ppu->frame_pixels[idx + 3] =   0xFF;  // A
-		// if (rand() % 2) {
-		// 	ppu->frame_pixels[idx]     = 0;  // R
-		// 	ppu->frame_pixels[idx + 1] = 0;  // G
-		// 	ppu->frame_pixels[idx + 2] = 0;  // B
-		// 	ppu->frame_pixels[idx + 3] =   0xFF;  // A
-		// } else {
-		// 	ppu->frame_pixels[idx]     = 0xFF;  // R
-		// 	ppu->frame_pixels[idx + 1] = 0xFF;  // G
-		// 	ppu->frame_pixels[idx + 2] = 0xFF;  // B
-		// 	ppu->frame_pixels[idx + 3] =   0xFF;  // A
-		// }
+		int x = ppu->cycle - 1;
+		uint8_t bg = (bg_palette << 2) | bg_pixel;
+		if (bg_pixel == 0 || (x < 8 && !(ppu->mask & MASK_BG_LEFT)))
+			bg = 0;
+
+		// merging has to happen anyway for the sprite 0 hit
+		uint8_t color = merge_sprite(ppu, x, bg);
+		if (!ppu->suppress_output) {
+			if (x == 0)
+				ppu->line_emphasis[ppu->scanline] = ppu->mask >> MASK_EMPHASIS_SHIFT;
+			ppu->frame_index[ppu->scanline * NES_RES_WIDTH + x] = ppu_read(ppu->nes, 0x3F00 + color) & 0x3F;
+		}
 	}
 
+	ppu->dots++;
 	ppu->cycle++;
 	if (ppu->cycle >= 341)
 	{
@@ -349,7 +488,222 @@ void ppu_clock(PPU *ppu)
 			ppu->frame_ready = true;
 		}
 	}
+}
+
+// Fetches the nametable and attribute bytes for the background tile at
+// `v` (a packed loopy address) like ppu_clock does over a group of 8 dots,
+// and returns the address of the tile's pattern row
+static uint16_t fetch_tile(PPU *ppu, uint16_t v, uint8_t *attrib)
+{
+	uint8_t id = *ppu_nametable(ppu, v);
+	uint8_t coarse_x = v & 0x1F;
+	uint8_t coarse_y = (v >> 5) & 0x1F;
+
+	uint8_t at = *ppu_nametable(ppu, 0x03C0 | (v & 0x0C00) | ((coarse_y >> 2) << 3) | (coarse_x >> 2));
+	if (coarse_y & 0x02) at >>= 4;
+	if (coarse_x & 0x02) at >>= 2;
+
+	*attrib = at & 0x03;
+	return (ppu->ctrl & CTRL_BG_TABLE ? 0x1000 : 0) + ((uint16_t)id << 4) + loopy_fine_y(v);
+}
+
+// Writes the 8 pixels of a background tile row as stream entries, 4 at a
+// time: each byte that holds an opaque pixel gets the attribute added in.
+// The opaque mask is 0 or 1 per byte, so the multiply can't carry over
+static void emit_tile(uint8_t *out, uint16_t row, uint8_t attrib)
+{
+	uint32_t left = pixel_quads[row >> 8];
+	uint32_t right = pixel_quads[row & 0xFF];
+	uint32_t palette = (uint32_t)attrib << 2;
+
+	left |= ((left | left >> 1) & 0x01010101) * palette;
+	right |= ((right | right >> 1) & 0x01010101) * palette;
+	memcpy(out, &left, sizeof(left));
+	memcpy(out + 4, &right, sizeof(right));
+}
+
+/*
+Runs a whole visible scanline (dots 0-340) with background rendering on,
+leaving the PPU exactly as 341 ppu_clock calls would.
+
+What ppu_clock does over a line boils down to a stream of pixels: the 16
+still in the shifters (the two tiles prefetched at the end of the previous
+line) followed by the 32 tiles fetched on this line, with pixel x coming
+from stream position x + fine_x. Tiles go into the stream 8 pixels at a
+time and fine x is applied by starting the line that far into it. That
+is merged with the sprite line buffer, and the line ends by prefetching
+two tiles, evaluating the sprites for the next one and telling the
+cartridge about the scanline.
+*/
+static void render_line(PPU *ppu)
+{
+	uint8_t stream[34 * 8];  // attribute << 2 | pixel per stream position, 0 when transparent
+	uint8_t colors[32];
+	uint16_t v = ppu->vram_addr;
+	uint8_t *line = &stream[ppu->fine_x];
+
+	// with output suppressed the background only matters for a sprite 0 hit
+	bool draw = !ppu->suppress_output;
+	bool need_bg = draw || (ppu->sprite_zero_on_line && !(ppu->status & STATUS_SPRITE_ZERO));
+
+	if (need_bg) {
+		// the first two tiles are read straight out of the shifters
+		for (int p = 0; p < 16; p++)
+		{
+			int bit = 15 - p;
+			uint8_t pixel = ((ppu->bg_shifter_pattern_hi >> bit) & 1) << 1 | ((ppu->bg_shifter_pattern_lo >> bit) & 1);
+			uint8_t attrib = ((ppu->bg_shifter_attrib_hi >> bit) & 1) << 1 | ((ppu->bg_shifter_attrib_lo >> bit) & 1);
+			stream[p] = pixel ? attrib << 2 | pixel : 0;
+		}
 
+		for (int t = 2; t < 34; t++)
+		{
+			uint8_t attrib;
+			uint16_t row = ppu_read_row(ppu->nes, fetch_tile(ppu, v, &attrib));
+			v = loopy_inc_x(v);
+			emit_tile(&stream[t * 8], row, attrib);
+		}
+
+		if (!(ppu->mask & MASK_BG_LEFT))
+			memset(line, 0, 8);
+	} else {
+		// 32 coarse x increments come back around in the other nametable
+		v ^= 0x0400;
+	}
+
+	if (draw) {
+		// the palette can't change mid-line on this path
+		for (int i = 0; i < 32; i++)
+			colors[i] = ppu_read(ppu->nes, 0x3F00 + i) & 0x3F;
+
+		uint8_t *out = &ppu->frame_index[ppu->scanline * NES_RES_WIDTH];
+		if (ppu->sprite_count == 0) {
+			for (int x = 0; x < NES_RES_WIDTH; x++)
+				out[x] = colors[line[x]];
+		} else {
+			for (int x = 0; x < NES_RES_WIDTH; x++)
+				out[x] = colors[merge_sprite(ppu, x, line[x])];
+		}
+		ppu->line_emphasis[ppu->scanline] = ppu->mask >> MASK_EMPHASIS_SHIFT;
+	} else if (need_bg) {
+		for (int x = 0; x < NES_RES_WIDTH && !(ppu->status & STATUS_SPRITE_ZERO); x++)
+			merge_sprite(ppu, x, line[x]);
+	}
+
+	// dot 256: coarse x was already bumped by the last fetch; dot 257
+	// copies horizontal bits from t, and dots 321-336 prefetch two tiles
+	v = loopy_inc_y(v);
+	v = (v & ~LOOPY_HORIZONTAL) | (ppu->tram_addr & LOOPY_HORIZONTAL);
+
+	uint8_t lsb[2], msb[2], at[2];
+	for (int t = 0; t < 2; t++)
+	{
+		uint16_t pattern = fetch_tile(ppu, v, &at[t]);
+		lsb[t] = ppu_read(ppu->nes, pattern);
+		msb[t] = ppu_read(ppu->nes, pattern + 8);
+		v = loopy_inc_x(v);
+	}
+
+	ppu->bg_shifter_pattern_lo = (uint16_t)lsb[0] << 8 | lsb[1];
+	ppu->bg_shifter_pattern_hi = (uint16_t)msb[0] << 8 | msb[1];
+	ppu->bg_shifter_attrib_lo = ((at[0] & 0b01) ? 0xFF00 : 0x0000) | ((at[1] & 0b01) ? 0x00FF : 0x0000);
+	ppu->bg_shifter_attrib_hi = ((at[0] & 0b10) ? 0xFF00 : 0x0000) | ((at[1] & 0b10) ? 0x00FF : 0x0000);
+	ppu->bg_next_tile_lsb = lsb[1];
+	ppu->bg_next_tile_msb = msb[1];
+	ppu->bg_next_tile_attrib = at[1];
+	ppu->bg_next_tile_id = ppu_read(ppu->nes, 0x2000 | (v & 0x0FFF));
+
+	ppu->vram_addr = v;
+
+	if (ppu->scanline < NES_RES_HEIGHT - 1)
+		evaluate_sprites(ppu, ppu->scanline + 1);
+	ppu_scanline(ppu->nes);
+}
+
+/*
+Advances up to `dots` dots, stopping at the end of the current line, over
+a stretch where the PPU does nothing but wait: the post-render and vblank
+lines, or any line with rendering off. All that happens there is setting
+and clearing the PPUSTATUS flags at their dots, the backdrop color on
+visible pixels and the (empty, with rendering off) sprite evaluation, so
+the whole stretch costs about as much as a single dot of ppu_clock.
+*/
+static void skip_line(PPU *ppu, uint64_t dots)
+{
+	// dot (0, 0) is skipped
+	if (ppu->scanline == 0 && ppu->cycle == 0)
+		ppu->cycle = 1;
+
+	int16_t first = ppu->cycle;
+	int16_t end = dots < (uint64_t)(DOTS_PER_LINE - first) ? first + (int16_t)dots : DOTS_PER_LINE;
+
+	if (ppu->scanline == -1 && first <= 1 && end > 1) {
+		ppu->status &= ~(STATUS_VBLANK | STATUS_SPRITE_ZERO | STATUS_OVERFLOW);
+	}
+	if (ppu->scanline == 241 && first <= 1 && end > 1) {
+		ppu->status |= STATUS_VBLANK;
+		if (ppu->ctrl & CTRL_NMI)
+			ppu->nmi = true;
+	}
+
+	if (ppu->scanline >= 0 && ppu->scanline < NES_RES_HEIGHT) {
+		// visible pixels x are output on dots x + 1
+		int16_t x0 = first > 1 ? first - 1 : 0;
+		int16_t x1 = end - 1 < NES_RES_WIDTH ? end - 1 : NES_RES_WIDTH;
+
+		if (x0 < x1 && !ppu->suppress_output) {
+			if (x0 == 0)
+				ppu->line_emphasis[ppu->scanline] = ppu->mask >> MASK_EMPHASIS_SHIFT;
+			memset(&ppu->frame_index[ppu->scanline * NES_RES_WIDTH + x0],
+				   ppu_read(ppu->nes, 0x3F00) & 0x3F, x1 - x0);
+		}
+	}
+	if (ppu->scanline < NES_RES_HEIGHT - 1 && first <= 257 && end > 257)
+		evaluate_sprites(ppu, ppu->scanline + 1);
+
+	ppu->dots += end - ppu->cycle;
+	ppu->cycle = end;
+	if (ppu->cycle >= DOTS_PER_LINE)
+	{
+		ppu->cycle = 0;
+		ppu->scanline++;
+		if (ppu->scanline >= 261)
+		{
+			ppu->scanline = -1;
+			ppu->frame_ready = true;
+		}
+	}
+}
+
+/*
+Clocks the PPU until `dots` reaches `target`. Visible lines with the
+background on that fit entirely before the target are done in one go by
+render_line, and lines where the PPU is idle (vblank, rendering off) by
+skip_line; everything else, including any line the CPU touches the
+PPU registers in the middle of (the scheduler catches the PPU up right
+before such an access), goes dot by dot through ppu_clock.
+*/
+void ppu_run(PPU *ppu, uint64_t target)
+{
+	while (ppu->dots < target)
+	{
+		if (ppu->scanline >= NES_RES_HEIGHT || !ppu_rendering(ppu)) {
+			skip_line(ppu, target - ppu->dots);
+			continue;
+		}
+		if (ppu->cycle == 0 && ppu->scanline >= 0 && ppu->scanline < NES_RES_HEIGHT && (ppu->mask & MASK_BG)) {
+			// dot (0, 0) is skipped
+			uint32_t line_dots = ppu->scanline == 0 ? DOTS_PER_LINE - 1 : DOTS_PER_LINE;
+
+			if (target - ppu->dots >= line_dots) {
+				render_line(ppu);
+				ppu->dots += line_dots;
+				ppu->scanline++;
+				continue;
+			}
+		}
+		ppu_clock(ppu);
+	}
 }
 
 
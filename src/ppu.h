@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include "cart.h"
 
 #define NES_RES_WIDTH  256
 #define NES_RES_HEIGHT 240
@@ -11,68 +12,61 @@
 #define BUTTON_COUNT   8
 #define PIXELS_LEN     NES_RES_WIDTH * NES_RES_HEIGHT * 4
 
-typedef struct Mask 
-{
-	uint8_t greyscale: 1 ;           // 0: 0 normal color, 1 produce greyscale display
-	uint8_t render_bg_left: 1 ;      // 1: 0 hide, 1 show background in leftmost 8 pixels of screen
-	uint8_t render_sprites_left: 1;  // 2: 0 hide, 1 show sprites in leftmost 8 pixels of screen                        
-	uint8_t render_bg: 1 ;           // 3: 1 show background
-	uint8_t render_sprites: 1  ;     // 4: 1 show sprites
-	uint8_t emph_red: 1;             // 5: emphasize red (green on PAL/Dendy)
-	uint8_t emph_green: 1;           // 6: emphasize green (red on PAL/Dendy)
-	uint8_t emph_blue: 1;            // 7: emphasize blue
-} Mask;
-
-
-typedef struct Controller
-{
-	uint8_t nametable_x: 1;          // 0: 1- Add 256 to the X scroll position
-	uint8_t nametable_y: 1;          // 1: 1- Add 240 to the Y scroll position
-	uint8_t increment_mode: 1;       // 2: VRAM address increment per CPU read/write of PPUDATA (0: add 1, going across 1: add 32, going down)
-	uint8_t pattern_sprite : 1;      // 3: Sprite pattern table address for 8x8 sprites (0: $0000 1: $1000 ignored in 8x16 mode)
-	uint8_t pattern_background : 1;  // 4: Background pattern table address (0: $0000 1: $1000)
-	uint8_t sprite_size : 1 ;        // 5: Sprite size (0: 8x8 pixels 1: 8x16 pixels – see PPU OAM#Byte 1)
-	uint8_t slave_mode : 1;          // 6: PPU master/slave select (0: read backdrop from EXT pins 1: output color on EXT pins)
-	uint8_t enable_nmi : 1 ;         // 7: Generate an NMI at the start of the vertical blanking interval (0: off 1: on)
-} Controller;
-
-
-typedef struct Status
-{
-	/*
-	    5: Sprite overflow. The intent was for this flag to be set
-           whenever more than eight sprites appear on a scanline, but a
-           hardware bug causes the actual behavior to be more complicated
-           and generate false positives as well as false negatives see
-           PPU sprite evaluation. This flag is set during sprite
-           evaluation and cleared at dot 1 (the second dot) of the
-           pre-render line.
-	*/
-	uint8_t sprite_overflow : 1;     
-
-	/* 
-		6: Sprite 0 Hit.  Set when a nonzero pixel of sprite 0 overlaps
-           a nonzero background pixel cleared at dot 1 of the pre-render 
-           line.  Used for raster timing.
-	*/ 
-	uint8_t sprite_zero_hit : 1;     
-
-	/* 
-		7: Vertical blank has started (0: not in vblank 1: in vblank). 
-		   Set at dot 1 of line 241 (the line *after* the post-render line) 
-		   cleared after reading $2002 and at dot 1 of the pre-render line
-	*/
-	uint8_t vertical_blank : 1;      
-} Status;
-
-
-typedef struct LoopyRegister {
-	uint16_t coarse_x : 5;
-	uint16_t coarse_y : 5;
-	uint16_t nametable_x : 1;
-	uint16_t nametable_y : 1;
-	uint16_t fine_y : 3;
-} LoopyRegister;
+/*
+The PPU registers are kept as plain integers in their hardware layout and
+taken apart with the masks below, so register writes are a single store
+and the loopy address can be incremented and copied with integer ops.
+*/
+
+// PPUCTRL $2000
+#define CTRL_NAMETABLE_X   0x01  // add 256 to the X scroll position
+#define CTRL_NAMETABLE_Y   0x02  // add 240 to the Y scroll position
+#define CTRL_INCREMENT     0x04  // VRAM address increment per PPUDATA access (0: add 1, going across 1: add 32, going down)
+#define CTRL_SPRITE_TABLE  0x08  // sprite pattern table for 8x8 sprites (0: $0000 1: $1000 ignored in 8x16 mode)
+#define CTRL_BG_TABLE      0x10  // background pattern table (0: $0000 1: $1000)
+#define CTRL_SPRITE_SIZE   0x20  // 0: 8x8 pixels 1: 8x16 pixels
+#define CTRL_SLAVE         0x40  // PPU master/slave select (0: read backdrop from EXT pins 1: output color on EXT pins)
+#define CTRL_NMI           0x80  // generate an NMI at the start of vertical blank
+
+// PPUMASK $2001
+#define MASK_GREYSCALE     0x01  // produce a greyscale display
+#define MASK_BG_LEFT       0x02  // show the background in the leftmost 8 pixels
+#define MASK_SPRITES_LEFT  0x04  // show sprites in the leftmost 8 pixels
+#define MASK_BG            0x08  // show the background
+#define MASK_SPRITES       0x10  // show sprites
+#define MASK_RENDERING     (MASK_BG | MASK_SPRITES)
+#define MASK_EMPHASIS      0xE0  // emphasize red, green, blue (red and green swapped on PAL/Dendy)
+#define MASK_EMPHASIS_SHIFT 5
+
+/*
+PPUSTATUS $2002
+Sprite overflow: meant to be set whenever more than eight sprites appear
+on a scanline (the real thing has false positives and negatives). Set
+during sprite evaluation and cleared at dot 1 of the pre-render line.
+Sprite 0 hit: set when a nonzero pixel of sprite 0 overlaps a nonzero
+background pixel, cleared at dot 1 of the pre-render line. Used for
+raster timing.
+Vertical blank: set at dot 1 of line 241 (the line *after* the
+post-render line), cleared after reading $2002 and at dot 1 of the
+pre-render line.
+*/
+#define STATUS_OVERFLOW    0x20
+#define STATUS_SPRITE_ZERO 0x40
+#define STATUS_VBLANK      0x80
+
+// Loopy VRAM address (v and t): 0yyy NNYY YYYX XXXX
+#define LOOPY_COARSE_X     0x001F
+#define LOOPY_COARSE_Y     0x03E0
+#define LOOPY_NAMETABLE_X  0x0400
+#define LOOPY_NAMETABLE_Y  0x0800
+#define LOOPY_FINE_Y       0x7000
+#define LOOPY_HORIZONTAL   (LOOPY_NAMETABLE_X | LOOPY_COARSE_X)
+#define LOOPY_VERTICAL     (LOOPY_FINE_Y | LOOPY_NAMETABLE_Y | LOOPY_COARSE_Y)
+#define LOOPY_ADDR         0x7FFF  // the registers are 15 bits wide
+
+static inline uint8_t loopy_coarse_x(uint16_t v) { return v & LOOPY_COARSE_X; }
+static inline uint8_t loopy_coarse_y(uint16_t v) { return (v & LOOPY_COARSE_Y) >> 5; }
+static inline uint8_t loopy_fine_y(uint16_t v)   { return (v & LOOPY_FINE_Y) >> 12; }
 
 typedef struct NES NES;
 
@@ -82,14 +76,20 @@ typedef struct PPU
 	// uint8_t *chr_rom;
 	// size_t chr_rom_size;
 	uint8_t palette_table[32];
-	uint8_t nametable[2][1024];
+	// 2 KiB of CIRAM plus 2 KiB for four-screen carts; nt_map points each
+	// of the four logical nametables at one of them (see ppu_set_mirroring)
+	uint8_t nametable[4][1024];
+	uint8_t *nt_map[4];
 	uint8_t oam_memory[256];
 
-	uint8_t frame_pixels[PIXELS_LEN];
+	// one 6-bit palette color per pixel; ppu_frame_to_rgba turns it into
+	// something displayable when a frame is actually shown
+	uint8_t frame_index[NES_RES_WIDTH * NES_RES_HEIGHT];
+	uint8_t line_emphasis[NES_RES_HEIGHT];  // PPUMASK bits 5-7 per line
 
-	Controller ctrl;  // PPUCTRL   $2000
-	Mask       mask;  // PPUMASK   $2001
-	Status   status;  // PPUSTATUS $2002
+	uint8_t ctrl;     // PPUCTRL   $2000, CTRL_*
+	uint8_t mask;     // PPUMASK   $2001, MASK_*
+	uint8_t status;   // PPUSTATUS $2002, STATUS_*
 
 	uint8_t oam_addr; // OAMADDR   $2003
 	uint8_t oam_data; // OAMDATA   $2004
@@ -109,12 +109,20 @@ typedef struct PPU
 	int16_t scanline;
 	int16_t cycle;
 
-	LoopyRegister vram_addr;
-	LoopyRegister tram_addr;
+	uint16_t vram_addr;  // v, LOOPY_*
+	uint16_t tram_addr;  // t
 
 	bool frame_ready;
 	bool nmi;
 
+	// frameskip: run the frame without touching frame_index. Everything
+	// the CPU can observe (scrolling, sprite 0 hit, overflow, NMI) still
+	// happens
+	bool suppress_output;
+
+	// number of ppu_clock calls so far, 3 per CPU cycle
+	uint64_t dots;
+
 	// Background rendering
 	uint8_t bg_next_tile_id;
 	uint8_t bg_next_tile_attrib;
@@ -124,6 +132,13 @@ typedef struct PPU
 	uint16_t bg_shifter_pattern_hi;
 	uint16_t bg_shifter_attrib_lo;
 	uint16_t bg_shifter_attrib_hi;
+
+	// Sprites on the current line, evaluated at dot 257 of the line before.
+	// sprite_line holds what they draw, see SPRITE_* in ppu.c
+	uint8_t secondary_oam[32];
+	uint8_t sprite_count;
+	bool sprite_zero_on_line;
+	uint8_t sprite_line[NES_RES_WIDTH];
 } PPU;
 
 
@@ -131,16 +146,25 @@ typedef struct PPU
 PPU *init_ppu();
 void reset_ppu(PPU *);
 
-uint8_t get_ppumask(PPU *);
-void set_ppumask(PPU *, uint8_t);
-uint8_t get_ppuctrl(PPU *);
-void set_ppuctrl(PPU *, uint8_t);
-uint8_t get_ppustatus(PPU *);
-void set_ppustatus(PPU *, uint8_t);
-uint16_t get_loopyregister(LoopyRegister *);
-void set_loopyregister(LoopyRegister *, uint16_t);
+static inline bool ppu_rendering(const PPU *ppu)
+{
+	return (ppu->mask & MASK_RENDERING) != 0;
+}
+
+void ppu_set_mirroring(PPU *, Mirroring);
+
+// Nametable byte at `addr` ($2000-$2FFF, mirrors included)
+static inline uint8_t *ppu_nametable(PPU *ppu, uint16_t addr)
+{
+	return &ppu->nt_map[(addr >> 10) & 0x03][addr & 0x03FF];
+}
 
 void ppu_clock(PPU *);
+void ppu_run(PPU *, uint64_t);
+uint32_t ppu_dots_to_event(const PPU *);
+uint32_t ppu_dots_to_scanline(const PPU *, uint32_t);
+void ppu_frame_to_rgba(const PPU *, uint32_t *);
+void ppu_load_palette(const char *);
 
 void inc_scroll_x(PPU *);
 void inc_scroll_y(PPU *);
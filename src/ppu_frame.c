@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ppu.h"
+
+/*
+Turns the PPU's palette index framebuffer into RGBA.
+
+The PPU only stores one 6-bit color per pixel, which is a quarter of the
+RGBA bytes, and the conversion is done here once per presented frame.
+Runs that never look at the picture (benchmarks, skipped frames) never pay
+for it at all.
+
+The lookup table holds 512 ready-made RGBA values, one per color and
+PPUMASK emphasis combination, so a pixel costs a single 32-bit load. With
+AVX2 eight pixels are converted at a time by widening the indices and
+gathering from the table; everything else reads it one pixel at a time.
+*/
+
+// default palette, replaced by ppu_load_palette
+static const uint8_t color_table[][3] = {
+	{ 84,  84,  84}, {  0,  30, 116}, {  8,  16, 144}, { 48,   0, 136}, { 68,   0, 100}, { 92,   0,  48}, { 84,   4,   0}, { 60,  24,   0}, { 32,  42,   0}, {  8,  58,   0}, {  0,  64,   0}, {  0,  60,   0}, {  0,  50,  60}, {  0,   0,   0}, {  0,   0,   0}, {  0,   0,   0},
+	{152, 150, 152}, {  8,  76, 196}, { 48,  50, 236}, { 92,  30, 228}, {136,  20, 176}, {160,  20, 100}, {152,  34,  32}, {120,  60,   0}, { 84,  90,   0}, { 40, 114,   0}, {  8, 124,   0}, {  0, 118,  40}, {  0, 102, 120}, {  0,   0,   0}, {  0,   0,   0}, {  0,   0,   0},
+	{236, 238, 236}, { 76, 154, 236}, {120, 124, 236}, {176,  98, 236}, {228,  84, 236}, {236,  88, 180}, {236, 106, 100}, {212, 136,  32}, {160, 170,   0}, {116, 196,   0}, { 76, 208,  32}, { 56, 204, 108}, { 56, 180, 204}, { 60,  60,  60}, {  0,   0,   0}, {  0,   0,   0},
+	{236, 238, 236}, {168, 204, 236}, {188, 188, 236}, {212, 178, 236}, {236, 174, 236}, {236, 174, 212}, {236, 180, 176}, {228, 196, 144}, {204, 210, 120}, {180, 222, 120}, {168, 226, 144}, {152, 226, 180}, {160, 214, 228}, {160, 162, 160}, {  0,   0,   0}, {  0,   0,   0}
+};
+
+#define PAL_COLORS     64
+#define PAL_EMPHASIS   8
+#define EMPHASIS_SCALE 209  // /256, how much emphasis dims the other channels
+
+// RGBA bytes in memory order, indexed by emphasis bits (PPUMASK >> 5) and color
+static uint32_t rgba_table[PAL_EMPHASIS][PAL_COLORS];
+static bool rgba_table_ready = false;
+
+static uint32_t pack_rgba(const uint8_t *rgb)
+{
+	uint32_t value;
+	uint8_t bytes[4] = { rgb[0], rgb[1], rgb[2], 0xFF };
+	memcpy(&value, bytes, 4);
+	return value;
+}
+
+// Builds all 8 emphasis variants from 64 base colors. The black columns
+// $xE/$xF are left alone, as on the real PPU
+static void build_rgba_table(const uint8_t (*base)[3])
+{
+	for (int e = 0; e < PAL_EMPHASIS; e++)
+	{
+		for (int i = 0; i < PAL_COLORS; i++)
+		{
+			uint8_t rgb[3] = { base[i][0], base[i][1], base[i][2] };
+
+			if ((i & 0x0E) != 0x0E) {
+				// bit 0 emphasizes red, bit 1 green, bit 2 blue; every
+				// emphasis bit dims the channels other than its own
+				for (int bit = 0; bit < 3; bit++)
+				{
+					if (!(e & (1 << bit)))
+						continue;
+					for (int c = 0; c < 3; c++)
+						if (c != bit)
+							rgb[c] = rgb[c] * EMPHASIS_SCALE / 256;
+				}
+			}
+			rgba_table[e][i] = pack_rgba(rgb);
+		}
+	}
+	rgba_table_ready = true;
+}
+
+/*
+Loads a palette from a .pal file: either exactly 64 RGB triples, with the
+emphasis variants derived as above, or exactly 512 triples that already
+contain them (the layout most palette generators write, emphasis bits as
+the high index). Anything else is rejected rather than guessed at.
+*/
+void ppu_load_palette(const char *fname)
+{
+	// one byte spare to tell a 512 color file from a longer one
+	uint8_t data[PAL_EMPHASIS * PAL_COLORS + 1][3];
+
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) {
+		perror("Opening palette file");
+		exit(EXIT_FAILURE);
+	}
+	size_t size = fread(data, 1, PAL_EMPHASIS * PAL_COLORS * 3 + 1, f);
+	fclose(f);
+
+	if (size == PAL_EMPHASIS * PAL_COLORS * 3) {
+		for (int i = 0; i < PAL_EMPHASIS * PAL_COLORS; i++)
+			rgba_table[i / PAL_COLORS][i % PAL_COLORS] = pack_rgba(data[i]);
+		rgba_table_ready = true;
+	} else if (size == PAL_COLORS * 3)
+		build_rgba_table(data);
+	else {
+		fprintf(stderr, "Error: %s is not a palette (expected 64 or 512 RGB triples)\n", fname);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void convert_scalar(const uint32_t *table, const uint8_t *index, uint32_t *out, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		out[i] = table[index[i] & 0x3F];
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_PATH 1
+
+__attribute__((target("avx2")))
+static void convert_avx2(const uint32_t *table, const uint8_t *index, uint32_t *out, size_t count)
+{
+	const __m256i mask = _mm256_set1_epi32(0x3F);
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i bytes = _mm_loadl_epi64((const __m128i *)&index[i]);
+		__m256i lanes = _mm256_and_si256(_mm256_cvtepu8_epi32(bytes), mask);
+		__m256i rgba = _mm256_i32gather_epi32((const int *)table, lanes, 4);
+		_mm256_storeu_si256((__m256i *)&out[i], rgba);
+	}
+	convert_scalar(table, &index[i], &out[i], count - i);
+}
+#endif
+
+// Each pixel of `out` ends up as R, G, B, A bytes, PIXELS_LEN bytes in all.
+// Emphasis is applied per line, using the PPUMASK value the line started with
+void ppu_frame_to_rgba(const PPU *ppu, uint32_t *out)
+{
+	if (!rgba_table_ready)
+		build_rgba_table(color_table);
+
+	void (*convert)(const uint32_t *, const uint8_t *, uint32_t *, size_t) = convert_scalar;
+#ifdef HAVE_AVX2_PATH
+	if (__builtin_cpu_supports("avx2"))
+		convert = convert_avx2;
+#endif
+
+	for (int y = 0; y < NES_RES_HEIGHT; y++)
+		convert(rgba_table[ppu->line_emphasis[y] & 0x07], &ppu->frame_index[y * NES_RES_WIDTH],
+			    &out[y * NES_RES_WIDTH], NES_RES_WIDTH);
+}
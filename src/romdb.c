@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cart.h"
+#include "romdb.h"
+
+#define ROMDB_DEFAULT_PATH "resources/romdb.txt"
+#define ROMDB_ENV          "NES_ROMDB"
+
+/*
+Header corrections for dumps that are known to carry bad iNES headers,
+keyed by the CRC-32 of their PRG and CHR ROM (the same key No-Intro and
+the NES 2.0 header database use, so entries can be copied from there).
+They are read from $NES_ROMDB, or resources/romdb.txt, which documents
+the format. A missing file just means no corrections.
+*/
+static RomInfo *romdb;
+static size_t romdb_len;
+static bool romdb_loaded;
+
+static int compare_crc(const void *a, const void *b)
+{
+	uint32_t x = ((const RomInfo *)a)->crc, y = ((const RomInfo *)b)->crc;
+	return x < y ? -1 : x > y;
+}
+
+static int parse_mirroring(char c)
+{
+	switch (c)
+	{
+		case 'H': return HORIZONTAL;
+		case 'V': return VERTICAL;
+		case '4': return FOUR_SCREEN;
+		case '-': return ROMDB_KEEP;
+		default:  return -1;
+	}
+}
+
+static void load_romdb(void)
+{
+	const char *path = getenv(ROMDB_ENV);
+	if (path == NULL)
+		path = ROMDB_DEFAULT_PATH;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return;
+
+	size_t capacity = 0;
+	char line[256];
+	for (int number = 1; fgets(line, sizeof(line), f) != NULL; number++)
+	{
+		char *start = line + strspn(line, " \t");
+		if (*start == '#' || *start == '\n' || *start == '\0')
+			continue;
+
+		unsigned crc, mapper, submapper, prg_ram_kb, battery, timing;
+		char mirroring;
+		int m;
+		if (sscanf(start, "%x %u %u %c %u %u %u", &crc, &mapper, &submapper, &mirroring,
+			   &prg_ram_kb, &battery, &timing) != 7 || (m = parse_mirroring(mirroring)) < 0
+		    || mapper > 4095 || submapper > 15 || prg_ram_kb > 255 || battery > 1 || timing > TIMING_DENDY) {
+			printf("[WARNING] %s:%d: cannot parse ROM database entry\n", path, number);
+			continue;
+		}
+
+		if (romdb_len == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			romdb = realloc(romdb, capacity * sizeof(RomInfo));
+		}
+		romdb[romdb_len++] = (RomInfo){ crc, mapper, submapper, m, prg_ram_kb, battery, timing };
+	}
+	fclose(f);
+
+	qsort(romdb, romdb_len, sizeof(RomInfo), compare_crc);
+}
+
+const RomInfo *romdb_find(uint32_t crc)
+{
+	if (!romdb_loaded) {
+		load_romdb();
+		romdb_loaded = true;
+	}
+
+	size_t lo = 0, hi = romdb_len;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (romdb[mid].crc == crc)
+			return &romdb[mid];
+		if (romdb[mid].crc < crc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
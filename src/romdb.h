@@ -0,0 +1,24 @@
+#ifndef _ROMDB_H
+#define _ROMDB_H
+
+#include <stdint.h>
+
+#define ROMDB_KEEP 0xFF  // leave the header's value alone
+
+// What a known dump's header should have said
+typedef struct RomInfo
+{
+	uint32_t crc;        // CRC-32 of PRG ROM followed by CHR ROM
+	uint16_t mapper_id;
+	uint8_t submapper;
+	uint8_t mirroring;   // Mirroring or ROMDB_KEEP (mapper controlled)
+	uint8_t prg_ram_kb;  // including battery-backed RAM
+	uint8_t battery;
+	uint8_t timing;      // Timing
+} RomInfo;
+
+// NULL for dumps we know nothing about. The database is read on first
+// use; call this once before starting threads that look things up
+const RomInfo *romdb_find(uint32_t crc);
+
+#endif
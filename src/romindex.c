@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "romindex.h"
+
+// Checks everything romindex_string and romindex_find rely on, so a
+// truncated or corrupt index is turned down instead of read out of bounds
+static bool romindex_valid(const RomIndex *index)
+{
+	const RomIndexHeader *header = index->header;
+	size_t expected = sizeof(RomIndexHeader) + (size_t)header->entry_count * sizeof(RomIndexEntry) + header->strings_size;
+
+	if (memcmp(header->magic, ROMINDEX_MAGIC, sizeof(header->magic)) || expected != index->map_size)
+		return false;
+
+	// every string ends before the pool does as long as the pool's last
+	// byte is a NUL
+	if (header->entry_count > 0 && (header->strings_size == 0 || index->strings[header->strings_size - 1] != '\0'))
+		return false;
+
+	for (uint32_t i = 0; i < header->entry_count; i++)
+	{
+		if (index->entries[i].path >= header->strings_size || index->entries[i].title >= header->strings_size)
+			return false;
+	}
+	return true;
+}
+
+// NULL if there is no index at `fname` or it isn't one we can read; the
+// caller then treats the library as not indexed yet
+RomIndex *romindex_open(const char *fname)
+{
+	int fd = open(fname, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(RomIndexHeader)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	RomIndex *index = malloc(sizeof(RomIndex));
+	index->map = map;
+	index->map_size = (size_t)st.st_size;
+	index->header = map;
+	index->entries = (const RomIndexEntry *)(index->header + 1);
+	index->strings = (const char *)(index->entries + index->header->entry_count);
+
+	if (!romindex_valid(index)) {
+		printf("[WARNING] %s is not a ROM index this version can read; ignoring it\n", fname);
+		romindex_close(index);
+		return NULL;
+	}
+	return index;
+}
+
+void romindex_close(RomIndex *index)
+{
+	if (index == NULL)
+		return;
+	munmap(index->map, index->map_size);
+	free(index);
+}
+
+// Entry for `path`, NULL if it isn't in the index
+const RomIndexEntry *romindex_find(const RomIndex *index, const char *path)
+{
+	size_t lo = 0, hi = index->header->entry_count;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		int cmp = strcmp(romindex_string(index, index->entries[mid].path), path);
+		if (cmp == 0)
+			return &index->entries[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+// Writes `count` entries, already sorted by path, and their string pool.
+// The index is built next to `fname` and renamed over it, so readers
+// that have the old one mapped keep a consistent copy
+void romindex_write(const char *fname, const RomIndexEntry *entries, uint32_t count, const char *strings, uint32_t strings_size)
+{
+	size_t len = strlen(fname);
+	char *tmp_name = malloc(len + 5);
+	memcpy(tmp_name, fname, len);
+	memcpy(tmp_name + len, ".tmp", 5);
+
+	FILE *f = fopen(tmp_name, "wb");
+	if (f == NULL) {
+		perror("Opening ROM index");
+		exit(EXIT_FAILURE);
+	}
+
+	RomIndexHeader header = { .entry_count = count, .strings_size = strings_size };
+	memcpy(header.magic, ROMINDEX_MAGIC, sizeof(header.magic));
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1
+	    || fwrite(entries, sizeof(RomIndexEntry), count, f) != count
+	    || fwrite(strings, 1, strings_size, f) != strings_size
+	    || fclose(f) != 0) {
+		perror("Writing ROM index");
+		exit(EXIT_FAILURE);
+	}
+
+	if (rename(tmp_name, fname) == -1) {
+		perror("Replacing ROM index");
+		exit(EXIT_FAILURE);
+	}
+	free(tmp_name);
+}
@@ -0,0 +1,74 @@
+#ifndef _ROMINDEX_H
+#define _ROMINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+On-disk index of a ROM library, written by nes-index and meant to be
+mmapped and used in place: a header, then entry_count fixed-size entries
+sorted by path, then a pool of NUL-terminated strings the entries point
+into. Paths are relative to the indexed directory.
+*/
+
+#define ROMINDEX_MAGIC "NESIDX1"
+
+// RomIndexEntry.flags
+#define ROMINDEX_VALID     0x01  // the header could be parsed, the fields below it mean something
+#define ROMINDEX_NES2      0x02
+#define ROMINDEX_BATTERY   0x04
+#define ROMINDEX_CHR_RAM   0x08
+#define ROMINDEX_SUPPORTED 0x10  // we have the mapper
+
+typedef struct RomIndexHeader
+{
+	char magic[8];
+	uint32_t entry_count;
+	uint32_t strings_size;
+} RomIndexHeader;
+
+_Static_assert(sizeof(RomIndexHeader) == 16, "RomIndexHeader is part of the file format");
+
+typedef struct RomIndexEntry
+{
+	uint32_t path;          // offsets into the string pool
+	uint32_t title;         // file name without the extension
+	int64_t mtime_sec;      // the file as it was indexed; a rescan only
+	int64_t mtime_nsec;     // reads files whose size or mtime changed
+	uint64_t file_size;
+
+	uint32_t crc;           // CRC-32 of PRG + CHR ROM
+	uint32_t prg_rom_size;  // in bytes
+	uint32_t chr_size;      // CHR ROM, or CHR RAM if ROMINDEX_CHR_RAM
+	uint32_t prg_ram_size;
+	uint16_t mapper_id;
+	uint8_t submapper;
+	uint8_t flags;          // ROMINDEX_*
+	uint8_t mirroring;      // Mirroring
+	uint8_t timing;         // Timing
+	uint8_t padding[10];    // zero; makes the whole entry explicit
+} RomIndexEntry;
+
+_Static_assert(sizeof(RomIndexEntry) == 64, "RomIndexEntry is part of the file format");
+
+typedef struct RomIndex
+{
+	void *map;
+	size_t map_size;
+	const RomIndexHeader *header;
+	const RomIndexEntry *entries;
+	const char *strings;
+} RomIndex;
+
+RomIndex *romindex_open(const char *);
+void romindex_close(RomIndex *);
+const RomIndexEntry *romindex_find(const RomIndex *, const char *);
+void romindex_write(const char *, const RomIndexEntry *, uint32_t, const char *, uint32_t);
+
+static inline const char *romindex_string(const RomIndex *index, uint32_t offset)
+{
+	return &index->strings[offset];
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+TraceRing *trace_ring_create(size_t capacity)
+{
+	TraceRing *ring = malloc(sizeof(TraceRing));
+	ring->records = malloc(capacity * sizeof(TraceRecord));
+	if (ring->records == NULL) {
+		perror("Allocating trace ring");
+		exit(EXIT_FAILURE);
+	}
+	ring->capacity = capacity;
+	ring->head = 0;
+	ring->count = 0;
+	return ring;
+}
+
+void trace_ring_delete(TraceRing *ring)
+{
+	free(ring->records);
+	free(ring);
+}
+
+void trace_ring_hook(void *ctx, const TraceRecord *record)
+{
+	TraceRing *ring = ctx;
+
+	ring->records[ring->head] = *record;
+	ring->head = (ring->head + 1) % ring->capacity;
+	if (ring->count < ring->capacity)
+		ring->count++;
+}
+
+// Writes the buffered records, oldest first, as raw binary
+size_t trace_ring_write(TraceRing *ring, FILE *f)
+{
+	size_t start = (ring->head + ring->capacity - ring->count) % ring->capacity;
+	size_t first = ring->count;
+
+	if (start + first > ring->capacity)
+		first = ring->capacity - start;
+
+	size_t written = fwrite(&ring->records[start], sizeof(TraceRecord), first, f);
+	written += fwrite(ring->records, sizeof(TraceRecord), ring->count - first, f);
+	return written;
+}
+
+// Formats the operand the way nestest.log does, e.g. "LDA ($80),Y"
+static void format_operand(const TraceRecord *record, char *buffer)
+{
+	const Instruction *inst = &instruction_table[record->opcode];
+	void (*mode)(CPU *) = inst->addr_mode;
+	uint8_t lo = record->operands[0];
+	uint16_t word = (uint16_t)record->operands[1] << 8 | lo;
+
+	if (mode == accumulator)
+		sprintf(buffer, "A");
+	else if (mode == immediate)
+		sprintf(buffer, "#$%02X", lo);
+	else if (mode == zero_page)
+		sprintf(buffer, "$%02X", lo);
+	else if (mode == zero_offset_x)
+		sprintf(buffer, "$%02X,X", lo);
+	else if (mode == zero_offset_y)
+		sprintf(buffer, "$%02X,Y", lo);
+	else if (mode == absolute)
+		sprintf(buffer, "$%04X", word);
+	else if (mode == abs_offset_x)
+		sprintf(buffer, "$%04X,X", word);
+	else if (mode == abs_offset_y)
+		sprintf(buffer, "$%04X,Y", word);
+	else if (mode == indirect)
+		sprintf(buffer, "($%04X)", word);
+	else if (mode == zero_indirect_x)
+		sprintf(buffer, "($%02X,X)", lo);
+	else if (mode == zero_indirect_y)
+		sprintf(buffer, "($%02X),Y", lo);
+	else if (mode == relative)
+		sprintf(buffer, "$%04X", (uint16_t)(record->PC + 2 + (int8_t)lo));
+	else
+		buffer[0] = '\0';
+}
+
+void trace_decode(const TraceRecord *record, FILE *f)
+{
+	const Instruction *inst = &instruction_table[record->opcode];
+	uint8_t length = instruction_length(inst);
+	char bytes[16];
+	char operand[16];
+
+	if (length == 1)
+		sprintf(bytes, "%02X", record->opcode);
+	else if (length == 2)
+		sprintf(bytes, "%02X %02X", record->opcode, record->operands[0]);
+	else
+		sprintf(bytes, "%02X %02X %02X", record->opcode, record->operands[0], record->operands[1]);
+
+	format_operand(record, operand);
+
+	fprintf(f, "%04X  %-8s  %.3s %-27s A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%u\n",
+		    record->PC, bytes, inst->name, operand,
+		    record->A, record->X, record->Y, record->P, record->SP, record->cycle);
+}
+
+// Decodes a binary trace produced by trace_ring_write into text
+size_t trace_decode_file(FILE *in, FILE *out)
+{
+	TraceRecord record;
+	size_t count = 0;
+
+	while (fread(&record, sizeof(TraceRecord), 1, in) == 1)
+	{
+		trace_decode(&record, out);
+		count++;
+	}
+	return count;
+}
@@ -0,0 +1,25 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+#include "cpu.h"
+
+// Ring buffer of the most recent instructions executed by the CPU.
+// Install with cpu_set_tracer(cpu, trace_ring_hook, ring)
+typedef struct TraceRing
+{
+	TraceRecord *records;
+	size_t capacity;
+	size_t head;   // next slot to be written
+	size_t count;  // number of valid records (<= capacity)
+} TraceRing;
+
+TraceRing *trace_ring_create(size_t);
+void trace_ring_delete(TraceRing *);
+void trace_ring_hook(void *, const TraceRecord *);
+size_t trace_ring_write(TraceRing *, FILE *);
+
+void trace_decode(const TraceRecord *, FILE *);
+size_t trace_decode_file(FILE *, FILE *);
+
+#endif
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+/*
+Offline decoder for binary traces written by `nes-headless --trace`.
+
+usage: nes-tracedump <trace.bin> [out.log]
+*/
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <trace.bin> [out.log]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		perror("Opening trace file");
+		return EXIT_FAILURE;
+	}
+
+	FILE *out = stdout;
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			perror("Opening output file");
+			return EXIT_FAILURE;
+		}
+	}
+
+	trace_decode_file(in, out);
+
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
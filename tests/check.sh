@@ -0,0 +1,54 @@
+#!/bin/sh
+# Runs the generated test ROMs on every CPU core, with and without idle
+# loop skipping, and checks that the frame and RAM dumps all match the
+# table core without skipping.
+# usage: check.sh path/to/nes-headless
+HEADLESS=${1:-./nes-headless}
+FRAMES=120
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+FAIL=0
+
+python3 "$(dirname "$0")/mkroms.py" "$DIR" || exit 1
+
+run()
+{
+	"$HEADLESS" "$DIR/$1.nes" -n $FRAMES --core $2 $3 \
+		--dump-frame "$DIR/out.ppm" --dump-ram "$DIR/out.ram" > /dev/null 2>&1 || return 1
+	cat "$DIR/out.ppm" "$DIR/out.ram" | cksum
+}
+
+for rom in nrom uxrom cnrom mmc1 mmc3 mmc3p alias; do
+	if ! ref=$(run $rom table --no-idle-skip); then
+		echo "FAIL: $rom.nes does not run on the table core"
+		FAIL=1
+		continue
+	fi
+	for core in table fused block jit; do
+		for skip in "" --no-idle-skip; do
+			if [ "$(run $rom $core $skip)" != "$ref" ]; then
+				echo "FAIL: $rom.nes --core $core $skip differs from the table core"
+				FAIL=1
+			fi
+		done
+	done
+done
+
+# the aliasing ROM leaves $AA at $11 when the bank switch is honoured
+for core in table fused block jit; do
+	run alias $core --no-idle-skip > /dev/null
+	if [ "$(od -An -tx1 -j17 -N1 "$DIR/out.ram" | tr -d ' ')" != "aa" ]; then
+		echo "FAIL: alias.nes --core $core ran a switched-out bank"
+		FAIL=1
+	fi
+done
+
+# badhdr.nes only runs correctly with its header corrected by the database
+NES_ROMDB="$DIR/romdb.txt" run badhdr jit > /dev/null
+if [ "$(od -An -tx1 -j17 -N1 "$DIR/out.ram" | tr -d ' ')" != "aa" ]; then
+	echo "FAIL: badhdr.nes was not corrected by the ROM database"
+	FAIL=1
+fi
+
+[ $FAIL -eq 0 ] && echo "all cores agree"
+exit $FAIL
@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+# Builds the small test ROMs used by `make check`.
+# usage: mkroms.py outdir
+import os, struct, sys, zlib
+
+OPS = {
+	('SEI', ''): 0x78, ('CLD', ''): 0xD8, ('CLI', ''): 0x58, ('CLC', ''): 0x18, ('SEC', ''): 0x38,
+	('TXS', ''): 0x9A, ('TXA', ''): 0x8A, ('TAY', ''): 0xA8, ('TYA', ''): 0x98,
+	('INX', ''): 0xE8, ('DEX', ''): 0xCA, ('DEY', ''): 0x88, ('NOP', ''): 0xEA,
+	('PHA', ''): 0x48, ('PLA', ''): 0x68, ('RTS', ''): 0x60, ('RTI', ''): 0x40, ('LSR', 'A'): 0x4A,
+	('LDA', '#'): 0xA9, ('LDX', '#'): 0xA2, ('LDY', '#'): 0xA0, ('CPX', '#'): 0xE0, ('CMP', '#'): 0xC9,
+	('ADC', '#'): 0x69, ('EOR', '#'): 0x49,
+	('LDA', 'z'): 0xA5, ('LDX', 'z'): 0xA6, ('STA', 'z'): 0x85, ('INC', 'z'): 0xE6, ('CMP', 'z'): 0xC5,
+	('LDA', 'a'): 0xAD, ('STA', 'a'): 0x8D, ('BIT', 'a'): 0x2C, ('JMP', 'a'): 0x4C, ('JSR', 'a'): 0x20,
+	('LDA', 'ax'): 0xBD, ('STA', 'ax'): 0x9D,
+	('BPL', 'r'): 0x10, ('BMI', 'r'): 0x30, ('BNE', 'r'): 0xD0, ('BEQ', 'r'): 0xF0,
+	('BVC', 'r'): 0x50, ('BVS', 'r'): 0x70,
+}
+SIZE = {'': 1, 'A': 1, '#': 2, 'z': 2, 'r': 2, 'a': 3, 'ax': 3}
+
+# A program is a list of instructions (mnemonic, mode[, operand]), labels
+# ("name:") and raw bytes. Operands may name a label.
+def assemble(prog, org):
+	labels = {}
+	for _ in range(2):
+		pc = org
+		out = bytearray()
+		for line in prog:
+			if isinstance(line, str):
+				labels[line[:-1]] = pc
+				continue
+			if isinstance(line, bytes):
+				out += line
+				pc += len(line)
+				continue
+			m, mode, *arg = line
+			out.append(OPS[(m, mode)])
+			v = arg[0] if arg else 0
+			if isinstance(v, str):
+				v = labels.get(v, pc)
+			if mode == 'r':
+				out.append((v - (pc + 2)) & 0xFF)
+			elif SIZE[mode] == 2:
+				out.append(v & 0xFF)
+			elif SIZE[mode] == 3:
+				out += struct.pack('<H', v)
+			pc += SIZE[mode]
+	return out, labels
+
+# Every 8 KiB PRG bank holds its number at offset $1000 so the program can
+# read back which bank is mapped. `banks` places extra code at the start of
+# a 16 KiB bank; the main program goes at `org` in the last bank.
+def build(path, prog, mapper, prg_kb, chr_kb, org, banks={}, flags6=1):
+	prg = bytearray(prg_kb * 1024)
+	for b in range(len(prg) // 8192):
+		prg[b * 8192 + 0x1000] = b
+	for b, (borg, bprog) in banks.items():
+		code, _ = assemble(bprog, borg)
+		base = b * 16384 + (borg & 0x3FFF)
+		prg[base:base + len(code)] = code
+	code, labels = assemble(prog, org)
+	base = len(prg) - (0x10000 - org)
+	prg[base:base + len(code)] = code
+	vec = lambda l: struct.pack('<H', labels[l])
+	prg[-6:] = vec('nmi') + vec('reset') + vec('irq')
+	chr = bytearray()
+	for k in range(chr_kb):
+		for t in range(64):
+			chr += bytes((t * 37 + r * 11 + k * 53) & 0xFF for r in range(8))
+			chr += bytes((t * 13 ^ r * 29 ^ k * 91) & 0xFF for r in range(8))
+	header = b'NES\x1a' + bytes([prg_kb // 16, chr_kb // 8, flags6 | (mapper & 15) << 4, mapper & 0xF0]) + bytes(8)
+	with open(path, 'wb') as f:
+		f.write(header + prg + chr)
+
+PAL = bytes([0x0F, 0x01, 0x11, 0x21, 0x0F, 0x06, 0x16, 0x26, 0x0F, 0x09, 0x19, 0x29, 0x0F, 0x02, 0x12, 0x22] * 2)
+SPR = bytes([40, 1, 0, 40, 60, 2, 1, 80, 80, 3, 0x42, 120, 100, 4, 0x83, 200])
+TAIL = ['paldata:', PAL, 'sprdata:', SPR]
+
+# wait for the PPU, load the palette, a nametable and OAM
+def init():
+	return ['reset:', ('SEI', ''), ('CLD', ''), ('LDX', '#', 0xFF), ('TXS', ''),
+		'w1:', ('BIT', 'a', 0x2002), ('BPL', 'r', 'w1'), 'w2:', ('BIT', 'a', 0x2002), ('BPL', 'r', 'w2'),
+		('LDA', '#', 0x3F), ('STA', 'a', 0x2006), ('LDA', '#', 0), ('STA', 'a', 0x2006), ('LDX', '#', 0),
+		'pal:', ('LDA', 'ax', 'paldata'), ('STA', 'a', 0x2007), ('INX', ''), ('CPX', '#', 0x20), ('BNE', 'r', 'pal'),
+		('LDA', '#', 0x20), ('STA', 'a', 0x2006), ('LDA', '#', 0), ('STA', 'a', 0x2006), ('LDY', '#', 8), ('LDX', '#', 0),
+		'nt:', ('TXA', ''), ('STA', 'a', 0x2007), ('INX', ''), ('BNE', 'r', 'nt'), ('DEY', ''), ('BNE', 'r', 'nt'),
+		('LDX', '#', 0), 'spr:', ('LDA', 'ax', 'sprdata'), ('STA', 'ax', 0x0200), ('INX', ''), ('CPX', '#', 16), ('BNE', 'r', 'spr'),
+		('LDA', '#', 0), ('STA', 'a', 0x2003), ('LDA', '#', 2), ('STA', 'a', 0x4014)]
+
+def start(ctrl):
+	return [('LDA', '#', 0), ('STA', 'a', 0x2005), ('STA', 'a', 0x2005),
+		('LDA', '#', ctrl), ('STA', 'a', 0x2000), ('LDA', '#', 0x1E), ('STA', 'a', 0x2001)]
+
+# NROM: polls $2002 in the main loop, NMI scrolls and moves sprites, and a
+# mid-frame scroll/$2006 split after a delay loop
+def nrom():
+	p = init() + start(0x80)
+	p += ['loop:', ('LDA', 'z', 0x10), 'wf:', ('CMP', 'z', 0x10), ('BEQ', 'r', 'wf'),
+		('LDA', 'z', 0x10), ('TAY', ''), 'd1:', ('LDX', '#', 0x40), 'd2:', ('DEX', ''), ('BNE', 'r', 'd2'), ('DEY', ''), ('BNE', 'r', 'd1'),
+		('LDA', 'z', 0x10), ('STA', 'a', 0x2005), ('STA', 'a', 0x2005),
+		('LDY', '#', 0x20), 'd3:', ('DEY', ''), ('BNE', 'r', 'd3'),
+		('LDA', '#', 0x16), ('STA', 'a', 0x2001), ('LDA', '#', 0x21), ('STA', 'a', 0x2006), ('LDA', 'z', 0x10), ('STA', 'a', 0x2006),
+		('LDY', '#', 0x30), 'd4:', ('DEY', ''), ('BNE', 'r', 'd4'),
+		('LDA', '#', 0x1E), ('STA', 'a', 0x2001), ('LDA', '#', 0x90), ('STA', 'a', 0x2000),
+		'poll:', ('BIT', 'a', 0x2002), ('BPL', 'r', 'poll'), ('INC', 'z', 0x11), ('JMP', 'a', 'loop')]
+	p += ['nmi:', ('PHA', ''), ('INC', 'z', 0x10), ('LDA', '#', 2), ('STA', 'a', 0x4014),
+		('LDA', 'z', 0x10), ('STA', 'a', 0x2005), ('LDA', '#', 0), ('STA', 'a', 0x2005),
+		('LDA', 'z', 0x10), ('STA', 'a', 0x0203), ('CLC', ''), ('ADC', '#', 3), ('STA', 'a', 0x0207),
+		('PLA', ''), ('RTI', ''), 'irq:', ('RTI', '')] + TAIL
+	return p
+
+def mmc3_sel(r, v):
+	return [('LDA', '#', r), ('STA', 'a', 0x8000), ('LDA', '#', v), ('STA', 'a', 0x8001)]
+
+# MMC3: PRG/CHR banking in both modes and a scanline IRQ that switches CHR
+def mmc3(poll):
+	p = init()
+	p += mmc3_sel(6, 3) + [('LDA', 'a', 0x9000), ('STA', 'z', 0x20)]
+	p += mmc3_sel(7, 4) + [('LDA', 'a', 0xB000), ('STA', 'z', 0x21)]
+	p += [('LDA', '#', 0x46), ('STA', 'a', 0x8000), ('LDA', 'a', 0xD000), ('STA', 'z', 0x22),
+		('LDA', 'a', 0x9000), ('STA', 'z', 0x23), ('LDA', '#', 0), ('STA', 'a', 0x8000)]
+	p += [('LDA', '#', 1), ('STA', 'a', 0xA000), ('LDA', '#', 40), ('STA', 'a', 0xC000), ('STA', 'a', 0xC001), ('STA', 'a', 0xE001)]
+	p += start(0x88) + [('CLI', '')]
+	if poll:
+		p += ['loop:', ('BIT', 'a', 0x2002), ('BPL', 'r', 'loop'), ('INC', 'z', 0x11), ('JMP', 'a', 'loop')]
+	else:
+		p += ['loop:', ('JMP', 'a', 'loop')]
+	p += ['nmi:', ('PHA', ''), ('INC', 'z', 0x10), ('LDA', '#', 2), ('STA', 'a', 0x4014)] + mmc3_sel(0, 0)
+	p += [('LDA', '#', 0), ('STA', 'z', 0x13), ('LDA', '#', 40), ('STA', 'a', 0xC000), ('STA', 'a', 0xC001), ('STA', 'a', 0xE001),
+		('PLA', ''), ('RTI', '')]
+	p += ['irq:', ('PHA', ''), ('STA', 'a', 0xE000), ('INC', 'z', 0x12), ('LDA', '#', 0), ('STA', 'a', 0x8000),
+		('INC', 'z', 0x13), ('LDA', 'z', 0x13), ('STA', 'a', 0x8001),
+		('LDA', '#', 30), ('STA', 'a', 0xC000), ('STA', 'a', 0xE001), ('PLA', ''), ('RTI', '')] + TAIL
+	return p
+
+def mmc1_write(addr, value):
+	out = [('LDA', '#', value)]
+	for i in range(5):
+		out += [('STA', 'a', addr)] + ([('LSR', 'A')] if i < 4 else [])
+	return out
+
+# MMC1: every PRG mode, 4 and 8 KiB CHR, mirroring and CHR switched each frame
+def mmc1():
+	p = init()
+	p += [('LDA', '#', 0x80), ('STA', 'a', 0x8000)] + mmc1_write(0x8000, 0x1E)
+	p += mmc1_write(0xE000, 3) + [('LDA', 'a', 0x9000), ('STA', 'z', 0x20)]
+	p += mmc1_write(0xE000, 5) + [('LDA', 'a', 0x9000), ('STA', 'z', 0x21)]
+	p += mmc1_write(0xA000, 5) + mmc1_write(0xC000, 2)
+	p += mmc1_write(0xE000, 7) + mmc1_write(0x8000, 0x0A) + [('LDA', 'a', 0xD000), ('STA', 'z', 0x22), ('LDA', 'a', 0x9000), ('STA', 'z', 0x23)]
+	p += mmc1_write(0x8000, 0x13) + mmc1_write(0xE000, 6) + [('LDA', 'a', 0x9000), ('STA', 'z', 0x24), ('LDA', 'a', 0xD000), ('STA', 'z', 0x25)]
+	p += mmc1_write(0x8000, 0x1F)
+	p += start(0x80) + ['loop:', ('JMP', 'a', 'loop')]
+	p += ['nmi:', ('PHA', ''), ('INC', 'z', 0x10), ('LDA', 'z', 0x10), ('LSR', 'A'), ('LSR', 'A'), ('LSR', 'A'), ('LSR', 'A')]
+	p += [('STA', 'a', 0xA000), ('LSR', 'A')] * 4 + [('STA', 'a', 0xA000), ('PLA', ''), ('RTI', ''), 'irq:', ('RTI', '')] + TAIL
+	return p
+
+# UxROM with CHR RAM: bank switching plus pattern uploads through $2007
+def uxrom():
+	p = init()
+	p += [('LDA', '#', 2), ('STA', 'a', 'b2'), ('LDA', 'a', 0x9000), ('STA', 'z', 0x20),
+		('LDA', '#', 5), ('STA', 'a', 'b5'), ('LDA', 'a', 0x9000), ('STA', 'z', 0x21), ('LDA', 'a', 0xD000), ('STA', 'z', 0x22)]
+	p += [('LDA', '#', 0), ('STA', 'a', 0x2006), ('STA', 'a', 0x2006), ('LDY', '#', 32), ('LDX', '#', 0),
+		'cw:', ('TXA', ''), ('EOR', '#', 0x5A), ('ADC', '#', 0x13), ('STA', 'a', 0x2007), ('INX', ''), ('BNE', 'r', 'cw'), ('DEY', ''), ('BNE', 'r', 'cw')]
+	p += start(0x80) + ['loop:', ('JMP', 'a', 'loop'), 'nmi:', ('RTI', ''), 'irq:', ('RTI', ''),
+		'b2:', bytes([2]), 'b5:', bytes([5])] + TAIL
+	return p
+
+# CNROM: CHR bank switched from NMI
+def cnrom():
+	p = init() + start(0x80) + ['loop:', ('JMP', 'a', 'loop')]
+	p += ['nmi:', ('PHA', ''), ('INC', 'z', 0x10), ('LDA', 'z', 0x10), ('LSR', 'A'), ('LSR', 'A'), ('LSR', 'A'),
+		('STA', 'a', 0xF000), ('PLA', ''), ('RTI', ''), 'irq:', ('RTI', '')] + TAIL
+	return p
+
+# UxROM bank aliasing: the routine at $C100 in the fixed bank is run until
+# it is hot, then the same bank is mapped at $8000 and the routine entered
+# at $8100, where its first store switches itself out. The rest must come
+# from bank 0, leaving $11 = $AA; reusing the $C100 code leaves $55.
+def alias():
+	sub = [('STA', 'a', 0x8000), ('LDA', '#', 0x55), ('STA', 'z', 0x11), ('RTS', '')]
+	bank0 = [('STA', 'a', 0x8000), ('LDA', '#', 0xAA), ('STA', 'z', 0x11), ('RTS', '')]
+	p = ['reset:', ('SEI', ''), ('CLD', ''), ('LDX', '#', 0xFF), ('TXS', ''), ('LDY', '#', 40),
+		'hot:', ('LDA', '#', 1), ('JSR', 'a', 0xC100), ('DEY', ''), ('BNE', 'r', 'hot'),
+		('LDA', '#', 3), ('STA', 'a', 0x8000), ('LDA', '#', 0), ('JSR', 'a', 0x8100),
+		'loop:', ('JMP', 'a', 'loop'), 'nmi:', ('RTI', ''), 'irq:', ('RTI', '')]
+	# the reset code sits at $C000, below the shared routine
+	return p, {0: (0x8100, bank0), 3: (0xC100, sub)}
+
+def main():
+	out = sys.argv[1] if len(sys.argv) > 1 else '.'
+	os.makedirs(out, exist_ok=True)
+	path = lambda name: os.path.join(out, name)
+	build(path('nrom.nes'), nrom(), 0, 32, 8, 0x8000)
+	build(path('mmc3.nes'), mmc3(False), 4, 64, 32, 0xE000)
+	build(path('mmc3p.nes'), mmc3(True), 4, 64, 32, 0xE000)
+	build(path('mmc1.nes'), mmc1(), 1, 128, 32, 0xC000)
+	build(path('uxrom.nes'), uxrom(), 2, 128, 0, 0xC000)
+	build(path('cnrom.nes'), cnrom(), 3, 32, 32, 0x8000)
+	prog, banks = alias()
+	build(path('alias.nes'), prog, 2, 64, 0, 0xC000, banks)
+
+	# the same ROM with an NROM header, and a ROM database entry correcting it
+	build(path('badhdr.nes'), prog, 0, 64, 0, 0xC000, banks)
+	with open(path('badhdr.nes'), 'rb') as f:
+		crc = zlib.crc32(f.read()[16:])
+	with open(path('romdb.txt'), 'w') as f:
+		f.write('# badhdr.nes is UxROM\n%08X 2 0 - 8 0 0\n' % crc)
+
+main()